@@ -20,7 +20,139 @@
 #include <unistd.h>
 #include <fcntl.h>
 
-#define BUFFER_SIZE 4096
+#if !defined(__M2__)
+#include <errno.h>
+#include <sys/stat.h>
+#endif
+
+#define BUFFER_SIZE 1048576
+
+/* Writes all of bytes from buffer to output, however many writes it takes */
+void write_all(int output, char* buffer, int bytes)
+{
+	int done = 0;
+	int written;
+	while(done < bytes)
+	{
+		written = write(output, buffer + done, bytes - done);
+		if(written <= 0)
+		{
+			fputs("catm failed to write its output\n", stderr);
+			exit(EXIT_FAILURE);
+		}
+		done = done + written;
+	}
+}
+
+/* Copies the rest of input to output through buffer; only a read of 0 is the end */
+void copy_loop(int input, int output, char* buffer)
+{
+	int bytes = read(input, buffer, BUFFER_SIZE);
+	while(bytes > 0)
+	{
+		write_all(output, buffer, bytes);
+		bytes = read(input, buffer, BUFFER_SIZE);
+	}
+	if(bytes < 0)
+	{
+		fputs("catm failed to read an input\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+}
+
+#if !defined(__M2__)
+/* Set once the output has been seeked over a hole */
+int sparse_output;
+
+/*
+ * Has the kernel move the rest of input to output: copy_file_range between
+ * files, else splice when either end is a pipe. Both carry on from the
+ * current offsets, so whatever is left when they give up can still be
+ * copied through a buffer. Returns 0 if there is something left.
+ */
+int copy_offload(int input, int output)
+{
+	ssize_t n = copy_file_range(input, NULL, output, NULL, 1 << 30, 0);
+	int copied = n > 0;
+	while(n > 0) n = copy_file_range(input, NULL, output, NULL, 1 << 30, 0);
+	/* Files in /proc and /sys claim to be empty here, so only trust an end after some data */
+	if(0 == n && copied) return 1;
+
+	n = splice(input, NULL, output, NULL, 1 << 30, SPLICE_F_MOVE);
+	while(n > 0) n = splice(input, NULL, output, NULL, 1 << 30, SPLICE_F_MOVE);
+	return 0 == n;
+}
+
+/* Copies length bytes from input to output, in the kernel when it can */
+void copy_bytes(int input, int output, off_t length, char* buffer)
+{
+	ssize_t n = 1;
+	while(n > 0 && length > 0)
+	{
+		n = copy_file_range(input, NULL, output, NULL, length, 0);
+		if(n > 0) length = length - n;
+	}
+
+	int size;
+	int bytes;
+	while(length > 0)
+	{
+		size = BUFFER_SIZE;
+		if(length < size) size = length;
+		bytes = read(input, buffer, size);
+		if(bytes <= 0)
+		{
+			/* The input was cut short while being copied, or can't be read */
+			fputs("catm failed to read an input\n", stderr);
+			exit(EXIT_FAILURE);
+		}
+		write_all(output, buffer, bytes);
+		length = length - bytes;
+	}
+}
+
+/*
+ * Copies an input with holes one data extent at a time, seeking the output
+ * over the holes instead of writing their zeros out. Returns 0, having
+ * copied nothing, if the input has no holes or the output isn't a regular
+ * file; a block device can seek but would keep its old bytes in the holes.
+ */
+int copy_sparse(int input, int output, char* buffer)
+{
+	struct stat st;
+	if(0 != fstat(output, &st)) return 0;
+	if(!S_ISREG(st.st_mode)) return 0;
+	if(0 != fstat(input, &st)) return 0;
+	if(!S_ISREG(st.st_mode)) return 0;
+
+	off_t hole = lseek(input, 0, SEEK_HOLE);
+	lseek(input, 0, SEEK_SET);
+	if(hole < 0 || hole >= st.st_size) return 0;
+
+	off_t offset = 0;
+	off_t data = lseek(input, 0, SEEK_DATA);
+	while(data >= 0 && data < st.st_size)
+	{
+		hole = lseek(input, data, SEEK_HOLE);
+		if(hole < 0) hole = st.st_size;
+		lseek(input, data, SEEK_SET);
+		lseek(output, data - offset, SEEK_CUR);
+		copy_bytes(input, output, hole - data, buffer);
+		offset = hole;
+		data = lseek(input, hole, SEEK_DATA);
+	}
+	if(data < 0 && errno != ENXIO)
+	{
+		fputs("catm failed to find the data in an input\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+
+	/* The rest of the input is a hole; the output is extended over it at the end */
+	lseek(output, st.st_size - offset, SEEK_CUR);
+	sparse_output = 1;
+	return 1;
+}
+#endif
 
 /********************************************************************************
  * the reason why we are using read and write instead of fread and fwrite is    *
@@ -45,8 +177,13 @@ int main(int argc, char** argv)
 	}
 
 	int i;
-	int bytes;
-	char* buffer = calloc(BUFFER_SIZE + 1, sizeof(char));
+	int copied;
+	char* buffer = malloc(BUFFER_SIZE);
+	if(NULL == buffer)
+	{
+		fputs("catm failed to allocate its buffer\n", stderr);
+		exit(EXIT_FAILURE);
+	}
 	int input;
 	for(i = 2; i < argc ; i =  i + 1)
 	{
@@ -58,12 +195,20 @@ int main(int argc, char** argv)
 			fputs(" is not a valid input file name\n", stderr);
 			exit(EXIT_FAILURE);
 		}
-keep:
-		bytes = read(input, buffer, BUFFER_SIZE);
-		write(output, buffer, bytes);
-		if(BUFFER_SIZE == bytes) goto keep;
+		copied = 0;
+#if !defined(__M2__)
+		copied = copy_sparse(input, output, buffer);
+		if(!copied) copied = copy_offload(input, output);
+#endif
+		if(!copied) copy_loop(input, output, buffer);
+		close(input);
 	}
 
+#if !defined(__M2__)
+	/* A hole at the very end only exists once the file is extended over it */
+	if(sparse_output) ftruncate(output, lseek(output, 0, SEEK_CUR));
+#endif
+
 	free(buffer);
 	return EXIT_SUCCESS;
 }
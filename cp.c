@@ -22,11 +22,22 @@
 #include <fcntl.h>
 #include "M2libc/bootstrappable.h"
 
+#if !defined(__M2__)
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <linux/fs.h>  /* For FICLONE */
+#endif
+
 #define MAX_STRING 4096
-#define MAX_ARRAY 256
+#define BUFFER_SIZE 1048576
 
 /* Globals */
 int verbose;
+int recursive;
 
 /* UTILITY FUNCTIONS */
 
@@ -47,36 +58,48 @@ int find_last_char_pos(char* string, char a)
 	return i;
 }
 
-/* Function to find the length of a char**; an array of strings */
-int array_length(char** array)
+/* PROCESSING FUNCTIONS */
+
+/* Returns the part of path after its last slash */
+char* base_name(char* path)
 {
-	int length = 0;
-	while(array[length] != NULL)
-	{
-		length = length + 1;
-	}
-	return length;
+	return path + find_last_char_pos(path, '/') + 1;
+}
+
+char* join_path(char* dir, char* name)
+{
+	char* path = calloc(strlen(dir) + strlen(name) + 2, sizeof(char));
+	require(path != NULL, "Memory initialization of path in join_path failed\n");
+	strcpy(path, dir);
+	if((0 == path[0]) || ('/' != path[strlen(path) - 1])) strcat(path, "/");
+	strcat(path, name);
+	return path;
 }
 
 /* PROCESSING FUNCTIONS */
 
-char* directory_dest(char* dest, char* source, int require_directory)
+#if !defined(__M2__)
+/* The destination directory, opened once, that copies are created in with openat */
+int dest_dir_fd;
+#endif
+
+/* Works out once whether dest is a directory to copy the sources into */
+int is_directory(char* dest)
 {
 	/*
-	 * First, check if it is a directory to copy to.
 	 * We have two ways of knowing this:
 	 * - If the destination ends in a slash, the user has explicitly said
 	 *   it is a directory.
-	 * - Normally we would use stat() but we don't want to force support for
-	 *   that syscall onto the kernel, so we just attempt to chdir() into it
-	 *   and if it works then it must be a directory. A bit hacky, bit it
-	 *   works.
+	 * - Otherwise open it as a directory; M2-Planet doesn't have O_DIRECTORY
+	 *   so there we attempt to chdir() into it and if it works then it must
+	 *   be a directory. A bit hacky, bit it works.
 	 */
 	int isdirectory = FALSE;
 	if(dest[strlen(dest) - 1] == '/')
 	{
 		isdirectory = TRUE;
 	}
+#if defined(__M2__)
 	if(!isdirectory)
 	{ /* Use the other testing method */
 		/*
@@ -84,7 +107,7 @@ char* directory_dest(char* dest, char* source, int require_directory)
 		 * chdir successfully.
 		 */
 		char* current_path = calloc(MAX_STRING, sizeof(char));
-		require(current_path != NULL, "Memory initialization of current_path in directory_dest failed\n");
+		require(current_path != NULL, "Memory initialization of current_path in is_directory failed\n");
 		getcwd(current_path, MAX_STRING);
 		require(!match("", current_path), "getcwd() failed\n");
 		/*
@@ -93,16 +116,15 @@ char* directory_dest(char* dest, char* source, int require_directory)
 		 * it is relative and needs to be changed (by appending current_path
 		 * to the dest path).
 		 */
-		char* chdir_dest = calloc(MAX_STRING, sizeof(char));
-		require(chdir_dest != NULL, "Memory initialization of chdir_dest in directory_dest failed\n");
+		char* chdir_dest;
 		if(dest[0] != '/')
 		{ /* The path is relative, append current_path */
-			strcat(chdir_dest, current_path);
-			strcat(chdir_dest, "/");
-			strcat(chdir_dest, dest);
+			chdir_dest = join_path(current_path, dest);
 		}
 		else
 		{ /* The path is absolute */
+			chdir_dest = calloc(strlen(dest) + 1, sizeof(char));
+			require(chdir_dest != NULL, "Memory initialization of chdir_dest in is_directory failed\n");
 			strcpy(chdir_dest, dest);
 		}
 		if(0 <= chdir(chdir_dest))
@@ -112,59 +134,176 @@ char* directory_dest(char* dest, char* source, int require_directory)
 			 * happened, check that before we go any further.
 			 */
 			char* new_path = calloc(MAX_STRING, sizeof(char));
-			require(new_path != NULL, "Memory initialization of new_path in directory_dest failed\n");
+			require(new_path != NULL, "Memory initialization of new_path in is_directory failed\n");
 			getcwd(new_path, MAX_STRING);
 			if(!match(current_path, new_path))
 			{
 				isdirectory = TRUE;
 				chdir(current_path);
 			}
+			free(new_path);
 		}
 		free(chdir_dest);
 		free(current_path);
 	}
+#else
+	dest_dir_fd = open(dest, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if(dest_dir_fd >= 0) isdirectory = TRUE;
+#endif
 
-	/*
-	 * If it isn't a directory, and we require one, error out.
-	 * Otherwise, just return what we were given, we're done here.
-	 */
-	if(require_directory) require(isdirectory, "Provide a directory destination for multiple source files\n");
-	if(!isdirectory) return dest;
-
-	/* If it is, we need to make dest a full path */
-	/* 1. Get the basename of source */
-	char* basename = calloc(MAX_STRING, sizeof(char));
-	require(basename != NULL, "Memory initialization of basename in directory_dest failed\n");
-	int last_slash_pos = find_last_char_pos(source, '/');
-	if(last_slash_pos >= 0)
-	{ /* Yes, there is a slash in it, copy over everything after that pos */
-		unsigned spos; /* source pos */
-		unsigned bpos = 0; /* basename pos */
-		/* Do the actual copy */
-		for(spos = last_slash_pos + 1; spos < strlen(source); spos = spos + 1)
+	return isdirectory;
+}
+
+/* Copies the rest of in to out through a buffer, returns FALSE on an error */
+int copy_loop(int in, int out)
+{
+	char* buffer = malloc(BUFFER_SIZE);
+	require(buffer != NULL, "Memory initialization of buffer in copy_loop failed\n");
+	int n = read(in, buffer, BUFFER_SIZE);
+	int written;
+	int done;
+
+	while(n > 0)
+	{
+		done = 0;
+		while(done < n)
 		{
-			basename[bpos] = source[spos];
-			bpos = bpos + 1;
+			written = write(out, buffer + done, n - done);
+			if(written <= 0)
+			{
+				free(buffer);
+				return FALSE;
+			}
+			done = done + written;
 		}
+		n = read(in, buffer, BUFFER_SIZE);
 	}
-	else
-	{ /* No, there is no slash in it, hence the basename is just the source */
-		strcpy(basename, source);
+
+	free(buffer);
+	return n == 0;
+}
+
+#if !defined(__M2__)
+/* Copies length bytes at offset from in to the same offset in out */
+int copy_extent(int in, int out, off_t offset, off_t length)
+{
+	loff_t in_offset = offset;
+	loff_t out_offset = offset;
+	off_t end = offset + length;
+	ssize_t n = 1;
+
+	while(n > 0 && in_offset < end)
+	{
+		n = copy_file_range(in, &in_offset, out, &out_offset, end - in_offset, 0);
 	}
-	/* 2. Ensure our dest (which is a directory) has a trailing slash */
-	if(dest[strlen(dest) - 1] != '/')
+	if(in_offset >= end) return TRUE;
+
+	/* copy_file_range can't do it (old kernel, odd filesystem), use a buffer */
+	char* buffer = malloc(BUFFER_SIZE);
+	require(buffer != NULL, "Memory initialization of buffer in copy_extent failed\n");
+	int size;
+	int written;
+	int done;
+	while(in_offset < end)
 	{
-		strcat(dest, "/");
+		size = BUFFER_SIZE;
+		if(end - in_offset < size) size = end - in_offset;
+		n = pread(in, buffer, size, in_offset);
+		if(n <= 0) break;
+		done = 0;
+		while(done < n)
+		{
+			written = pwrite(out, buffer + done, n - done, in_offset + done);
+			if(written <= 0) break;
+			done = done + written;
+		}
+		if(done < n) break;
+		in_offset = in_offset + n;
 	}
-	/* 3. Add the basename to the end of the directory */
-	strcat(dest, basename);
-	free(basename);
 
-	/* Now we have a returnable path! */
-	return dest;
+	free(buffer);
+	return in_offset >= end;
+}
+
+/*
+ * Copies a file with holes one data extent at a time, skipping the holes
+ * so they stay holes in the freshly truncated destination. The extents are
+ * copied with positional I/O and in is put back at its start on failure, so
+ * the file can be copied again the dense way. Returns FALSE if in has no
+ * holes, can't report them, out isn't a regular file (a device keeps its old
+ * bytes where the holes are), or the copy failed.
+ */
+int copy_sparse(int in, int out)
+{
+	struct stat st;
+	if(0 != fstat(out, &st)) return FALSE;
+	if(!S_ISREG(st.st_mode)) return FALSE;
+	if(0 != fstat(in, &st)) return FALSE;
+	if(!S_ISREG(st.st_mode)) return FALSE;
+
+	off_t hole = lseek(in, 0, SEEK_HOLE);
+	lseek(in, 0, SEEK_SET);
+	if(hole < 0 || hole >= st.st_size) return FALSE;
+
+	off_t data = lseek(in, 0, SEEK_DATA);
+	while(data >= 0 && data < st.st_size)
+	{
+		hole = lseek(in, data, SEEK_HOLE);
+		if(hole < 0) hole = st.st_size;
+		if(!copy_extent(in, out, data, hole - data))
+		{
+			lseek(in, 0, SEEK_SET);
+			return FALSE;
+		}
+		data = lseek(in, hole, SEEK_DATA);
+	}
+	int found_end = (data >= 0) || (errno == ENXIO);
+	lseek(in, 0, SEEK_SET);
+	if(!found_end) return FALSE;
+
+	/* Past the last extent there is no data left to find, just a hole */
+	return 0 == ftruncate(out, st.st_size);
+}
+
+/*
+ * Has the kernel do the copy: a reflink sharing the blocks on filesystems
+ * that can (btrfs, xfs), then a hole preserving copy for sparse files,
+ * else copy_file_range, else sendfile. All of these but the sparse copy
+ * carry on from the current file offsets, so when one gives up part way the
+ * next one picks up from there. Returns FALSE if the rest still needs copying.
+ */
+int copy_offload(int in, int out)
+{
+	ssize_t n;
+
+	if(0 == ioctl(out, FICLONE, in)) return TRUE;
+	if(copy_sparse(in, out)) return TRUE;
+
+	n = copy_file_range(in, NULL, out, NULL, 1 << 30, 0);
+	int copied = n > 0;
+	while(n > 0) n = copy_file_range(in, NULL, out, NULL, 1 << 30, 0);
+	/* Files in /proc and /sys claim to be empty here, so only trust an end after some data */
+	if(0 == n && copied) return TRUE;
+
+	n = sendfile(out, in, NULL, 1 << 30);
+	while(n > 0) n = sendfile(out, in, NULL, 1 << 30);
+	return 0 == n;
+}
+#endif
+
+/* Prints dest_dir/dest, or just dest if dest_dir is NULL */
+void put_dest(char* dest_dir, char* dest, FILE* f)
+{
+	if(dest_dir != NULL)
+	{
+		fputs(dest_dir, f);
+		if(dest_dir[strlen(dest_dir) - 1] != '/') fputc('/', f);
+	}
+	fputs(dest, f);
 }
 
-void copy_file(char* source, char* dest)
+/* Copies source to dest, which is inside dest_dir unless that is NULL */
+void copy_file(char* source, char* dest_dir, char* dest)
 {
 	if(verbose)
 	{ /* Output message */
@@ -172,58 +311,361 @@ void copy_file(char* source, char* dest)
 		fputs("'", stdout);
 		fputs(source, stdout);
 		fputs("' -> '", stdout);
-		fputs(dest, stdout);
+		put_dest(dest_dir, dest, stdout);
 		fputs("'\n", stdout);
 	}
 
-	/* Open source and dest as FILE*s */
-	FILE* fsource = fopen(source, "r");
-	if(fsource == NULL)
+	/* Open source and dest as file descriptors */
+	int fsource = open(source, O_RDONLY, 0);
+	if(fsource < 0)
 	{
 		fputs("Error opening source file ", stderr);
 		fputs(source, stderr);
 		fputc('\n', stderr);
 		exit(EXIT_FAILURE);
 	}
-	FILE* fdest = fopen(dest, "w");
+#if defined(__M2__)
+	char* path = dest;
+	if(dest_dir != NULL) path = join_path(dest_dir, dest);
+	int fdest = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if(path != dest) free(path);
+#else
+	int dir_fd = AT_FDCWD;
+	if(dest_dir != NULL) dir_fd = dest_dir_fd;
+	int fdest = openat(dir_fd, dest, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+#endif
 	if(fdest < 0)
 	{
-		fputs("Error opening destination file", stderr);
-		fputs(dest, stderr);
+		fputs("Error opening destination file ", stderr);
+		put_dest(dest_dir, dest, stderr);
 		fputc('\n', stderr);
 		exit(EXIT_FAILURE);
 	}
 
-	/*
-	 * The following loop reads a character from the source and writes it to the
-	 * dest file. This is all M2-Planet supports.
-	 */
-	int c = fgetc(fsource);
-	while(c != EOF)
+	int copied = FALSE;
+#if !defined(__M2__)
+	copied = copy_offload(fsource, fdest);
+#endif
+	if(!copied) copied = copy_loop(fsource, fdest);
+	if(!copied)
 	{
-		fputc(c, fdest);
-		c = fgetc(fsource);
+		fputs("Error copying ", stderr);
+		fputs(source, stderr);
+		fputc('\n', stderr);
+		exit(EXIT_FAILURE);
 	}
 
 	/* Cleanup */
-	fclose(fsource);
-	fclose(fdest);
+	close(fsource);
+	close(fdest);
+}
+
+#if !defined(__M2__)
+/* RECURSIVE COPYING */
+
+/* A directory being copied; its mode and times are set once its last entry is done */
+struct copy_dir
+{
+	char* dest;
+	struct stat st;
+	int pending; /* Entries not yet copied, plus one while it is being read */
+	struct copy_dir* parent;
+};
+
+/* A file, symlink or directory waiting for a copy worker */
+struct copy_task
+{
+	char* source;
+	char* dest;
+	struct stat st;
+	struct copy_dir* parent;
+	struct copy_task* next;
+};
+
+/* Each worker has its own stack of tasks; an idle worker steals from the others */
+struct copy_worker
+{
+	pthread_t thread;
+	pthread_mutex_t lock;
+	struct copy_task* tasks;
+};
+
+struct copy_worker* workers;
+int worker_count;
+/* Held for queued and tasks_left, with workers waiting on walk_cond for work */
+pthread_mutex_t walk_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t walk_cond = PTHREAD_COND_INITIALIZER;
+int queued;
+int tasks_left; /* Queued or running tasks, the copy is over when it reaches 0 */
+
+void push_task(struct copy_worker* worker, char* source, char* dest, struct stat* st, struct copy_dir* parent)
+{
+	struct copy_task* task = calloc(1, sizeof(struct copy_task));
+	require(task != NULL, "Memory initialization of task in push_task failed\n");
+	task->source = source;
+	task->dest = dest;
+	task->st = st[0];
+	task->parent = parent;
+
+	pthread_mutex_lock(&worker->lock);
+	task->next = worker->tasks;
+	worker->tasks = task;
+	pthread_mutex_unlock(&worker->lock);
+
+	pthread_mutex_lock(&walk_lock);
+	queued = queued + 1;
+	tasks_left = tasks_left + 1;
+	pthread_cond_signal(&walk_cond);
+	pthread_mutex_unlock(&walk_lock);
+}
+
+struct copy_task* take_task(struct copy_worker* worker)
+{
+	struct copy_task* task;
+	pthread_mutex_lock(&worker->lock);
+	task = worker->tasks;
+	if(task != NULL) worker->tasks = task->next;
+	pthread_mutex_unlock(&worker->lock);
+	return task;
+}
+
+/* Returns the next task, its own first then stolen, or NULL once the copy is over */
+struct copy_task* next_task(struct copy_worker* worker)
+{
+	struct copy_task* task;
+	int i;
+
+	while(TRUE)
+	{
+		task = take_task(worker);
+		for(i = 0; (task == NULL) && (i < worker_count); i = i + 1) task = take_task(workers + i);
+
+		pthread_mutex_lock(&walk_lock);
+		if(task != NULL)
+		{
+			queued = queued - 1;
+			pthread_mutex_unlock(&walk_lock);
+			return task;
+		}
+		while((queued <= 0) && (tasks_left > 0)) pthread_cond_wait(&walk_cond, &walk_lock);
+		if(tasks_left == 0)
+		{
+			pthread_mutex_unlock(&walk_lock);
+			return NULL;
+		}
+		pthread_mutex_unlock(&walk_lock);
+	}
+}
+
+void finish_task()
+{
+	pthread_mutex_lock(&walk_lock);
+	tasks_left = tasks_left - 1;
+	if(tasks_left == 0) pthread_cond_broadcast(&walk_cond);
+	pthread_mutex_unlock(&walk_lock);
+}
+
+void copy_metadata(char* dest, struct stat* st)
+{
+	struct timespec times[2];
+	times[0] = st->st_atim;
+	times[1] = st->st_mtim;
+	if(!S_ISLNK(st->st_mode)) chmod(dest, st->st_mode & 07777);
+	utimensat(AT_FDCWD, dest, times, AT_SYMLINK_NOFOLLOW);
+}
+
+/* One entry of dir is copied, when none are left the directory is done too */
+void dir_done(struct copy_dir* dir)
+{
+	while((dir != NULL) && (0 == __atomic_sub_fetch(&dir->pending, 1, __ATOMIC_ACQ_REL)))
+	{
+		/* Only now, writing entries into it would change its times */
+		copy_metadata(dir->dest, &dir->st);
+		struct copy_dir* parent = dir->parent;
+		free(dir->dest);
+		free(dir);
+		dir = parent;
+	}
+}
+
+void copy_directory(struct copy_worker* worker, struct copy_task* task)
+{
+	struct copy_dir* dir = calloc(1, sizeof(struct copy_dir));
+	require(dir != NULL, "Memory initialization of dir in copy_directory failed\n");
+	struct dirent* entry;
+	struct stat st;
+
+	if(verbose)
+	{
+		fputs("'", stdout);
+		fputs(task->source, stdout);
+		fputs("' -> '", stdout);
+		fputs(task->dest, stdout);
+		fputs("'\n", stdout);
+	}
+
+	/* Writable until it's done, whatever its final mode */
+	if((0 != mkdir(task->dest, 0700)) && ((EEXIST != errno) || (0 != stat(task->dest, &st)) || !S_ISDIR(st.st_mode)))
+	{
+		fputs("Error creating destination directory ", stderr);
+		fputs(task->dest, stderr);
+		fputc('\n', stderr);
+		exit(EXIT_FAILURE);
+	}
+	DIR* d = opendir(task->source);
+	if(d == NULL)
+	{
+		fputs("Error opening source directory ", stderr);
+		fputs(task->source, stderr);
+		fputc('\n', stderr);
+		exit(EXIT_FAILURE);
+	}
+
+	dir->dest = task->dest;
+	dir->st = task->st;
+	dir->pending = 1;
+	dir->parent = task->parent;
+
+	/* readdir reads the entries in bulk with getdents64 */
+	for(entry = readdir(d); entry != NULL; entry = readdir(d))
+	{
+		if(match(entry->d_name, ".") || match(entry->d_name, "..")) continue;
+		if(0 != fstatat(dirfd(d), entry->d_name, &st, AT_SYMLINK_NOFOLLOW))
+		{
+			fputs("Error reading ", stderr);
+			fputs(entry->d_name, stderr);
+			fputc('\n', stderr);
+			exit(EXIT_FAILURE);
+		}
+		__atomic_add_fetch(&dir->pending, 1, __ATOMIC_ACQ_REL);
+		push_task(worker, join_path(task->source, entry->d_name), join_path(task->dest, entry->d_name), &st, dir);
+	}
+
+	closedir(d);
+	dir_done(dir);
+}
+
+void copy_entry(struct copy_worker* worker, struct copy_task* task)
+{
+	char* target;
+	ssize_t n;
+
+	if(S_ISDIR(task->st.st_mode))
+	{
+		/* The directory reports to its parent itself once all of it is copied */
+		copy_directory(worker, task);
+		free(task->source);
+		return;
+	}
+
+	if(S_ISLNK(task->st.st_mode))
+	{
+		target = calloc(task->st.st_size + 1, sizeof(char));
+		require(target != NULL, "Memory initialization of target in copy_entry failed\n");
+		n = readlink(task->source, target, task->st.st_size);
+		unlink(task->dest);
+		if((n < 0) || (0 != symlink(target, task->dest)))
+		{
+			fputs("Error copying symlink ", stderr);
+			fputs(task->source, stderr);
+			fputc('\n', stderr);
+			exit(EXIT_FAILURE);
+		}
+		free(target);
+	}
+	else if(S_ISREG(task->st.st_mode)) copy_file(task->source, NULL, task->dest);
+	else
+	{
+		fputs("Skipping special file ", stderr);
+		fputs(task->source, stderr);
+		fputc('\n', stderr);
+		dir_done(task->parent);
+		free(task->source);
+		free(task->dest);
+		return;
+	}
+
+	copy_metadata(task->dest, &task->st);
+	dir_done(task->parent);
+	free(task->source);
+	free(task->dest);
+}
+
+void* copy_worker_run(void* arg)
+{
+	struct copy_worker* worker = arg;
+	struct copy_task* task = next_task(worker);
+
+	while(task != NULL)
+	{
+		copy_entry(worker, task);
+		free(task);
+		finish_task();
+		task = next_task(worker);
+	}
+
+	return NULL;
+}
+
+/* Copies the tree at source to dest on a pool of workers, keeping modes and times */
+void copy_tree(char* source, char* dest)
+{
+	struct stat st;
+	int i;
+
+	if(0 != lstat(source, &st))
+	{
+		fputs("Error opening source file ", stderr);
+		fputs(source, stderr);
+		fputc('\n', stderr);
+		exit(EXIT_FAILURE);
+	}
+
+	worker_count = sysconf(_SC_NPROCESSORS_ONLN);
+	if(worker_count < 1) worker_count = 1;
+	workers = calloc(worker_count, sizeof(struct copy_worker));
+	require(workers != NULL, "Memory initialization of workers failed\n");
+	for(i = 0; i < worker_count; i = i + 1) pthread_mutex_init(&workers[i].lock, NULL);
+
+	push_task(workers, strdup(source), strdup(dest), &st, NULL);
+	for(i = 0; i < worker_count; i = i + 1)
+	{
+		require(0 == pthread_create(&workers[i].thread, NULL, copy_worker_run, workers + i), "Unable to start a copy worker\n");
+	}
+	for(i = 0; i < worker_count; i = i + 1) pthread_join(workers[i].thread, NULL);
+	free(workers);
+}
+#endif
+
+/* Copies one source, the whole tree under it with -r */
+void copy_source(char* source, char* dest_dir, char* dest)
+{
+#if !defined(__M2__)
+	if(recursive)
+	{
+		if(dest_dir != NULL) dest = join_path(dest_dir, dest);
+		copy_tree(source, dest);
+		if(dest_dir != NULL) free(dest);
+		return;
+	}
+#endif
+	copy_file(source, dest_dir, dest);
 }
 
 int main(int argc, char** argv)
 {
 	/* Initialize variables */
-	char** sources = calloc(MAX_ARRAY, sizeof(char*));
+	/* Every argument that isn't an option is a path, so argc bounds them */
+	char** sources = calloc(argc + 1, sizeof(char*));
 	require(sources != NULL, "Memory initialization of sources failed\n");
 	int sources_index = 0;
 	char* dest = NULL;
 
 	/* Set defaults */
 	verbose = FALSE;
+	recursive = FALSE;
 
 	int i = 1;
-	int j;
-	int args_found;
 	/* Loop arguments */
 	while(i <= argc)
 	{
@@ -235,7 +677,7 @@ int main(int argc, char** argv)
 		{
 			fputs("Usage: ", stdout);
 			fputs(argv[0], stdout);
-			fputs(" [-h | --help] [-V | --version] [-v | --verbose] source1 source2 sourcen destination\n", stdout);
+			fputs(" [-h | --help] [-V | --version] [-v | --verbose] [-r | --recursive] source1 source2 sourcen destination\n", stdout);
 			exit(EXIT_SUCCESS);
 		}
 		else if(match(argv[i], "-V") || match(argv[i], "--version"))
@@ -248,37 +690,19 @@ int main(int argc, char** argv)
 			verbose = TRUE;
 			i = i + 1;
 		}
+		else if(match(argv[i], "-r") || match(argv[i], "-R") || match(argv[i], "--recursive"))
+		{
+#if defined(__M2__)
+			fputs("Recursive copies need a native build of cp\n", stderr);
+			exit(EXIT_FAILURE);
+#endif
+			recursive = TRUE;
+			i = i + 1;
+		}
 		else if(argv[i][0] != '-')
-		{ /* It is not an option */
-			/*
-			 * We can tell if this is the source file or the destination file
-			 * through looking *ahead*. If it is the last of this type of argument then
-			 * it must be the destination. (1 destination, many sources).
-			 */
-			j = i + 1;
-			args_found = 0;
-			while(j < array_length(argv))
-			{
-				if(argv[j][0] != '-')
-				{ /* It's one of these type of arguments */
-					args_found = args_found + 1;
-				}
-				j = j + 1;
-			}
-			if(args_found == 0)
-			{ /* We are setting the destination (there are no more left after this) */
-				dest = calloc(MAX_STRING, sizeof(char));
-				require(dest != NULL, "Memory initialization of dest failed\n");
-				strcpy(dest, argv[i]);
-			}
-			else
-			{ /* We are setting a source */
-				require(sources_index < MAX_ARRAY, "Too many files\n");
-				sources[sources_index] = calloc(MAX_STRING, sizeof(char));
-				require(sources[sources_index] != NULL, "Memory initialization of sources[source_index] failed\n");
-				strcpy(sources[sources_index], argv[i]);
-				sources_index = sources_index + 1;
-			}
+		{ /* It is not an option, collect it and sort them out at the end */
+			sources[sources_index] = argv[i];
+			sources_index = sources_index + 1;
 			i = i + 1;
 		}
 		else
@@ -288,6 +712,14 @@ int main(int argc, char** argv)
 		}
 	}
 
+	/* The last path is the destination (1 destination, many sources) */
+	if(sources_index > 0)
+	{
+		sources_index = sources_index - 1;
+		dest = sources[sources_index];
+		sources[sources_index] = NULL;
+	}
+
 	/* Sanitize values */
 	/* Ensure the two values have values */
 	/* Another workaround for short-circuit bug */
@@ -300,33 +732,22 @@ int main(int argc, char** argv)
 	if(error == FALSE) if(match(dest, "")) error = TRUE;
 	require(!error, "Provide a destination file\n");
 
+	/*
+	 * Work out once if we are copying into a directory, each source then goes
+	 * to its basename in there. If there is more than one source, we have to
+	 * be copying to a directory destination...
+	 */
+	int into_directory = is_directory(dest);
+	if(sources_index > 1) require(into_directory, "Provide a directory destination for multiple source files\n");
+
 	/* Loop through all of the sources, copying each one */
-	char* this_dest;
-	for(i = 0; i < array_length(sources); i = i + 1)
+	for(i = 0; i < sources_index; i = i + 1)
 	{
-		/* Convert the dest variable to a full path if it's a directory copying to */
-		/*
-		 * Also, if there is more than one source, we have to be copying to
-		 * a directory destination...
-		 */
-		if(array_length(sources) == 1)
-		{
-			dest = directory_dest(dest, sources[i], FALSE);
-			copy_file(sources[i], dest);
-		}
-		else
-		{
-			this_dest = calloc(MAX_STRING, sizeof(char));
-			require(this_dest != NULL, "Memory initalization of this_dest failed\n");
-			this_dest = directory_dest(dest, sources[i], TRUE);
-			copy_file(sources[i], this_dest);
-		}
-		/* Perform the actual copy */
-		free(sources[i]);
+		if(into_directory) copy_source(sources[i], dest, base_name(sources[i]));
+		else copy_source(sources[i], NULL, dest);
 	}
 
 	free(sources);
-	free(dest);
 
 	return EXIT_SUCCESS;
 }
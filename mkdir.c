@@ -37,6 +37,65 @@
 
 int parents;
 
+/* Directories this run has created, hashed by path, so creating the parents
+ * of a path stops at the first one already made instead of failing a mkdir
+ * for every level.
+ */
+#define DIR_CACHE_SIZE 4096
+
+struct dir_entry
+{
+	char* path;
+	struct dir_entry* next;
+};
+
+struct dir_entry** dir_cache;
+
+int dir_hash(char* path)
+{
+	int h = 5381;
+
+	while(0 != path[0])
+	{
+		h = ((h << 5) + h + (0xFF & path[0])) & 0xFFFFFF;
+		path = path + 1;
+	}
+
+	return h % DIR_CACHE_SIZE;
+}
+
+int dir_cached(char* path)
+{
+	struct dir_entry* e;
+	if(NULL == dir_cache) return FALSE;
+
+	for(e = dir_cache[dir_hash(path)]; NULL != e; e = e->next)
+	{
+		if(match(e->path, path)) return TRUE;
+	}
+
+	return FALSE;
+}
+
+void cache_dir(char* path)
+{
+	struct dir_entry* e = calloc(1, sizeof(struct dir_entry));
+	int h = dir_hash(path);
+	require(NULL != e, "failed to allocate the directory cache\n");
+
+	if(NULL == dir_cache)
+	{
+		dir_cache = calloc(DIR_CACHE_SIZE, sizeof(struct dir_entry*));
+		require(NULL != dir_cache, "failed to allocate the directory cache\n");
+	}
+
+	e->path = calloc(strlen(path) + 1, sizeof(char));
+	require(NULL != e->path, "failed to allocate the directory cache\n");
+	strcpy(e->path, path);
+	e->next = dir_cache[h];
+	dir_cache[h] = e;
+}
+
 /* Create a directory, including parent directories as necessary. */
 void create_dir(char *pathname, int mode)
 {
@@ -49,6 +108,9 @@ void create_dir(char *pathname, int mode)
 		pathname[strlen(pathname) - 1] = '\0';
 	}
 
+	/* An earlier argument already made it. */
+	if(parents && dir_cached(pathname)) return;
+
 	/* Try creating the directory. */
 	r = mkdir(pathname, mode);
 
@@ -60,12 +122,19 @@ void create_dir(char *pathname, int mode)
 		if(p != NULL)
 		{
 			p[0] = '\0';
-			create_dir(pathname, mode);
+			/* If we made the parent, creating it again won't help. */
+			if(!dir_cached(pathname))
+			{
+				create_dir(pathname, mode);
+				p[0] = '/';
+				r = mkdir(pathname, mode);
+			}
 			p[0] = '/';
-			r = mkdir(pathname, mode);
 		}
 	}
 
+	if(r == 0) cache_dir(pathname);
+
 	if((r != 0) && !parents)
 	{
 		fputs("Could not create directory ", stderr);
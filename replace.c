@@ -21,61 +21,354 @@
 #include <unistd.h>
 #include "M2libc/bootstrappable.h"
 
+#if !defined(__M2__)
+#include <sys/stat.h>
+#endif
+
+/* The input is read this many bytes at a time. */
+#define BUFFER_SIZE 1048576
+
+/* A --match-on and --replace-with pair, in the order they were given. */
+struct rule
+{
+	char* pattern;
+	size_t length;
+	char* replacement;
+	size_t replacement_length;
+	struct rule* next;
+};
+
 char* input_name;
 FILE* input;
 char* output_name;
 FILE* output;
+/* Where an in place edit is written before it is renamed over output_name. */
+char* temp_name;
+struct rule* rules;
 char* pattern;
 size_t pattern_length;
 char* replacement;
+size_t replacement_length;
+/* The current chunk of input, after the bytes carried over from the last one. */
 char* buffer;
-size_t buffer_index;
-char* hold;
+size_t size;
+/* Horspool shift for each byte value, how far the last byte of the window can
+ * be from the end of the pattern.
+ */
+size_t* skip;
 
-void read_next_byte()
+/* Gives up when the output can't be written, removing a half written temp
+ * file so the original is left as it was.
+ */
+void output_failed()
+{
+	fputs("unable to write the output file\n", stderr);
+	if(NULL != temp_name) unlink(temp_name);
+	exit(EXIT_FAILURE);
+}
+
+/* Writes length bytes, NULs and all. */
+void write_bytes(char* bytes, size_t length)
+{
+	if(length != fwrite(bytes, sizeof(char), length, output)) output_failed();
+}
+
+/* Writes buffer[start:end]. */
+void write_span(size_t start, size_t end)
+{
+	if(end > start) write_bytes(buffer + start, end - start);
+}
+
+/* Reads the next chunk in after the carry bytes at the start of buffer.
+ * Returns TRUE when that reached the end of the input.
+ */
+int fill_buffer(size_t carry)
+{
+	size_t n = fread(buffer + carry, sizeof(char), BUFFER_SIZE, input);
+	size = carry + n;
+	return n < BUFFER_SIZE;
+}
+
+/* Writes buffer[start:keep] and moves what follows to the front of buffer for
+ * the next chunk, as it may be the start of a match. Returns its length.
+ */
+size_t carry_over(size_t start, size_t keep)
+{
+	if(keep < start) keep = start;
+	write_span(start, keep);
+	memmove(buffer, buffer + keep, size - keep);
+	return size - keep;
+}
+
+void build_skip()
 {
-	int c= hold[0];
 	size_t i = 0;
-	while(i < pattern_length)
+	skip = calloc(256, sizeof(size_t));
+	require(NULL != skip, "temp memory allocation failed\n");
+
+	while(i < 256)
 	{
-		hold[i] = hold[i+1];
+		skip[i] = pattern_length;
 		i = i + 1;
 	}
 
-	hold[pattern_length-1] = buffer[buffer_index];
-	buffer_index = buffer_index + 1;
+	i = 0;
+	while(i + 1 < pattern_length)
+	{
+		skip[0xFF & pattern[i]] = pattern_length - 1 - i;
+		i = i + 1;
+	}
+}
+
+/* Returns where the pattern next occurs in buffer at or after start, or size. */
+size_t find_next(size_t start)
+{
+#if defined(__M2__)
+	size_t last = pattern_length - 1;
+	int c;
+
+	while(start + pattern_length <= size)
+	{
+		c = 0xFF & buffer[start + last];
+		if((c == (0xFF & pattern[last])) && (0 == memcmp(buffer + start, pattern, last))) return start;
+		start = start + skip[c];
+	}
+
+	return size;
+#else
+	/* glibc uses Two-Way, with a vectorized scan for short patterns. */
+	char* p = memmem(buffer + start, size - start, pattern, pattern_length);
+	if(NULL == p) return size;
+	return p - buffer;
+#endif
+}
+
+/* With several rules, all of them are applied in one pass by an Aho-Corasick
+ * automaton. It is a full transition table, after reading byte c in state s
+ * the state is delta[256 * s + c]; found[s] is the longest rule whose pattern
+ * ends in state s, or NULL.
+ */
+int* delta;
+struct rule** found;
+/* How many bytes each state has matched, those can't be written out yet. */
+size_t* depth;
+
+void build_automaton()
+{
+	struct rule* r;
+	size_t total = 1;
+	size_t i;
+	int states = 1;
+	int* fail;
+	int* queue;
+	int head = 0;
+	int tail = 0;
+	int s;
+	int t;
+	int c;
+
+	for(r = rules; NULL != r; r = r->next) total = total + r->length;
+	delta = calloc(256 * total, sizeof(int));
+	found = calloc(total, sizeof(struct rule*));
+	depth = calloc(total, sizeof(size_t));
+	fail = calloc(total, sizeof(int));
+	queue = calloc(total, sizeof(int));
+	require((NULL != delta) && (NULL != found) && (NULL != depth) && (NULL != fail) && (NULL != queue), "temp memory allocation failed\n");
+
+	/* The trie of the patterns, state 0 is the root so 0 also means no edge yet */
+	for(r = rules; NULL != r; r = r->next)
+	{
+		s = 0;
+		for(i = 0; i < r->length; i = i + 1)
+		{
+			c = 0xFF & r->pattern[i];
+			if(0 == delta[256 * s + c])
+			{
+				delta[256 * s + c] = states;
+				depth[states] = depth[s] + 1;
+				states = states + 1;
+			}
+			s = delta[256 * s + c];
+		}
 
-	/* NEVER WRITE NULLS!!! */
-	if(0 != c) fputc(c, output);
+		/* Of identical patterns the first one given wins */
+		if(NULL == found[s]) found[s] = r;
+	}
+
+	/* Breadth first, so the fail state of each state is finished before it */
+	for(c = 0; c < 256; c = c + 1)
+	{
+		if(0 != delta[c])
+		{
+			queue[tail] = delta[c];
+			tail = tail + 1;
+		}
+	}
+
+	while(head < tail)
+	{
+		s = queue[head];
+		head = head + 1;
+		/* A shorter pattern that ends here counts when no longer one does */
+		if(NULL == found[s]) found[s] = found[fail[s]];
+
+		for(c = 0; c < 256; c = c + 1)
+		{
+			t = delta[256 * s + c];
+			if(0 != t)
+			{
+				fail[t] = delta[256 * fail[s] + c];
+				queue[tail] = t;
+				tail = tail + 1;
+			}
+			else delta[256 * s + c] = delta[256 * fail[s] + c];
+		}
+	}
+
+	free(fail);
+	free(queue);
 }
 
-void clear_hold()
+/* Replaces whichever match ends first, then starts over after it, so the
+ * replacements never overlap and their output is never matched again.
+ */
+void replace_all_rules()
 {
-	/* FILL hold with NULLS */
+	struct rule* r;
+	size_t carry = 0;
+	size_t start;
+	size_t i;
+	int s = 0;
+	int done;
+
+	do
+	{
+		done = fill_buffer(carry);
+		start = 0;
+		/* The carried bytes are already part of state s */
+		i = carry;
+
+		while(i < size)
+		{
+			s = delta[256 * s + (0xFF & buffer[i])];
+			i = i + 1;
+			r = found[s];
+
+			if(NULL != r)
+			{
+				write_span(start, i - r->length);
+				write_bytes(r->replacement, r->replacement_length);
+				start = i;
+				s = 0;
+			}
+		}
+
+		if(done) carry = carry_over(start, size);
+		else carry = carry_over(start, size - depth[s]);
+	} while(!done);
+}
+
+/* Replaces the single rule chunk by chunk, copying what lies between the
+ * matches in one go.
+ */
+void replace_one()
+{
+	size_t carry = 0;
+	size_t start;
+	size_t next;
+	size_t keep;
+	int done;
+
+	do
+	{
+		done = fill_buffer(carry);
+		start = 0;
+
+		while(TRUE)
+		{
+			next = find_next(start);
+			if(next == size) break;
+			write_span(start, next);
+			write_bytes(replacement, replacement_length);
+			start = next + pattern_length;
+		}
+
+		/* A match may straddle the chunks in the last pattern_length - 1 bytes */
+		keep = pattern_length - 1;
+		if(keep > size) keep = size;
+		if(done) keep = 0;
+		carry = carry_over(start, size - keep);
+	} while(!done);
+}
+
+/* Returns the value of a hex digit, or -1. */
+int hex_digit(int c)
+{
+	if((c >= '0') && (c <= '9')) return c - '0';
+	if((c >= 'a') && (c <= 'f')) return c - 'a' + 10;
+	if((c >= 'A') && (c <= 'F')) return c - 'A' + 10;
+	return -1;
+}
+
+/* Decodes a string of hex digit pairs into bytes, setting length. */
+char* parse_hex(char* s, size_t* length)
+{
+	char* r = calloc((strlen(s) / 2) + 1, sizeof(char));
 	size_t i = 0;
-	while(i < pattern_length)
+	int hi;
+	int lo;
+	require(NULL != r, "temp memory allocation failed\n");
+
+	while(0 != s[0])
 	{
-		hold[i] = 0;
+		require(0 != s[1], "hex strings need two digits for every byte\n");
+		hi = hex_digit(s[0]);
+		lo = hex_digit(s[1]);
+		require((0 <= hi) && (0 <= lo), "hex strings can only contain 0-9, a-f and A-F\n");
+		r[i] = (hi << 4) | lo;
 		i = i + 1;
+		s = s + 2;
 	}
+
+	length[0] = i;
+	return r;
 }
 
-void check_match()
+/* Returns the last rule, adding a new one if it already has the field that
+ * is being given, so the nth --match-on pairs with the nth --replace-with.
+ */
+struct rule* rule_for(int want_pattern)
 {
-	/* Do the actual replacing */
-	if(match(pattern, hold))
+	struct rule* r = rules;
+	struct rule* last = NULL;
+
+	while(NULL != r)
 	{
-		fputs(replacement, output);
-		clear_hold();
+		if(want_pattern && (NULL == r->pattern)) return r;
+		if(!want_pattern && (NULL == r->replacement)) return r;
+		last = r;
+		r = r->next;
 	}
+
+	r = calloc(1, sizeof(struct rule));
+	require(NULL != r, "temp memory allocation failed\n");
+	if(NULL == last) rules = r;
+	else last->next = r;
+	return r;
 }
 
 int main(int argc, char** argv)
 {
 	output_name = "/dev/stdout";
-	pattern = NULL;
-	replacement = NULL;
-	buffer_index = 0;
+	temp_name = NULL;
+	rules = NULL;
+	size_t shortest;
+	size_t longest;
+	struct rule* rule;
+#if !defined(__M2__)
+	struct stat in_st;
+	struct stat out_st;
+#endif
 
 	int i = 1;
 	while (i < argc)
@@ -98,14 +391,32 @@ int main(int argc, char** argv)
 		}
 		else if(match(argv[i], "-m") || match(argv[i], "--match-on"))
 		{
-			pattern = argv[i+1];
-			require(NULL != pattern, "the --match-on option requires a string to be given\n");
+			require(NULL != argv[i+1], "the --match-on option requires a string to be given\n");
+			rule = rule_for(TRUE);
+			rule->pattern = argv[i+1];
+			rule->length = strlen(rule->pattern);
+			i = i + 2;
+		}
+		else if(match(argv[i], "--match-on-hex"))
+		{
+			require(NULL != argv[i+1], "the --match-on-hex option requires a hex string to be given\n");
+			rule = rule_for(TRUE);
+			rule->pattern = parse_hex(argv[i+1], &rule->length);
 			i = i + 2;
 		}
 		else if(match(argv[i], "-r") || match(argv[i], "--replace-with"))
 		{
-			replacement = argv[i+1];
-			require(NULL != replacement, "the --replace-with option requires a string to be given\n");
+			require(NULL != argv[i+1], "the --replace-with option requires a string to be given\n");
+			rule = rule_for(FALSE);
+			rule->replacement = argv[i+1];
+			rule->replacement_length = strlen(rule->replacement);
+			i = i + 2;
+		}
+		else if(match(argv[i], "--replace-with-hex"))
+		{
+			require(NULL != argv[i+1], "the --replace-with-hex option requires a hex string to be given\n");
+			rule = rule_for(FALSE);
+			rule->replacement = parse_hex(argv[i+1], &rule->replacement_length);
 			i = i + 2;
 		}
 		else if(match(argv[i], "-h") || match(argv[i], "--help"))
@@ -116,6 +427,8 @@ int main(int argc, char** argv)
 			fputs(" --match-on $string", stderr);
 			fputs(" --replace-with $string", stderr);
 			fputs(" [--output $output] (or it'll dump to stdout)\n", stderr);
+			fputs("--match-on and --replace-with can be repeated to do several replacements in one pass\n", stderr);
+			fputs("--match-on-hex and --replace-with-hex take the bytes as hex digits, like 00ff\n", stderr);
 			fputs("--help to get this message\n", stderr);
 			exit(EXIT_SUCCESS);
 		}
@@ -131,40 +444,91 @@ int main(int argc, char** argv)
 	/* Sanity check that we got everything we need */
 	require(NULL != input_name, "You need to pass an input file with --file\n");
 	require(NULL != output_name, "You need to pass an output file with --output\n");
-	require(NULL != pattern, "You can't do a replacement without something to match on\n");
-	require(NULL != replacement, "You can't do a replacement without something to replace it with\n");
+	require(NULL != rules, "You can't do a replacement without something to match on\n");
+	for(rule = rules; NULL != rule; rule = rule->next)
+	{
+		require(NULL != rule->pattern, "You can't do a replacement without something to match on\n");
+		require(NULL != rule->replacement, "You can't do a replacement without something to replace it with\n");
+		require(0 < rule->length, "You can't match on an empty string\n");
+	}
 
 	input = fopen(input_name, "r");
 	require(NULL != input, "unable to open requested input file!\n");
 
-	/* Get enough buffer to read it all */
+	/* Save ourself work if the input file is too small */
 	fseek(input, 0, SEEK_END);
-	size_t size = ftell(input);
-	buffer = malloc((size + 8) * sizeof(char));
+	size = ftell(input);
+	fseek(input, 0, SEEK_SET);
+	shortest = rules->length;
+	longest = rules->length;
+	for(rule = rules; NULL != rule; rule = rule->next)
+	{
+		if(rule->length < shortest) shortest = rule->length;
+		if(rule->length > longest) longest = rule->length;
+	}
+	require(shortest < size, "input file is to small for pattern\n");
 
-	/* Save ourself work if the input file is too small */
-	pattern_length = strlen(pattern);
-	require(pattern_length < size, "input file is to small for pattern\n");
+	/* Room for a chunk and the start of a match carried over from the last one */
+	buffer = malloc((BUFFER_SIZE + longest) * sizeof(char));
+	require(NULL != buffer, "temp memory allocation failed\n");
 
-	/* Now read it all into buffer */
-	fseek(input, 0, SEEK_SET);
-	size_t r = fread(buffer,sizeof(char), size, input);
-	require(r == size, "incomplete read of input\n");
-	fclose(input);
+	/* Editing a file in place, write a new one next to it and rename that over
+	 * it at the end, so it is never left half written.
+	 */
+	if(match(input_name, output_name)) temp_name = output_name;
+#if !defined(__M2__)
+	else if((0 == stat(input_name, &in_st)) && (0 == stat(output_name, &out_st))
+	        && (in_st.st_dev == out_st.st_dev) && (in_st.st_ino == out_st.st_ino)) temp_name = output_name;
+#endif
+
+	if(NULL != temp_name)
+	{
+		temp_name = calloc(strlen(output_name) + 13, sizeof(char));
+		require(NULL != temp_name, "temp memory allocation failed\n");
+		strcpy(temp_name, output_name);
+		strcat(temp_name, ".replace-tmp");
+		output = fopen(temp_name, "w");
+#if !defined(__M2__)
+		/* Keep the permissions of the file being replaced */
+		if((NULL != output) && (0 == stat(output_name, &out_st))) fchmod(fileno(output), out_st.st_mode & 07777);
+#endif
+	}
+	else output = fopen(output_name, "w");
+	require(NULL != output, "unable to open requested output file!\n");
+
+	if(NULL != rules->next)
+	{
+		build_automaton();
+		replace_all_rules();
+	}
+	else
+	{
+		pattern = rules->pattern;
+		pattern_length = rules->length;
+		replacement = rules->replacement;
+		replacement_length = rules->replacement_length;
+		build_skip();
+		replace_one();
+	}
 
-	/* Now we can safely open the output (which could have been the same as the input */
-	output = fopen(output_name, "w");
-	require(NULL != input, "unable to open requested output file!\n");
+	fclose(input);
 
-	/* build our match buffer */
-	hold = calloc(pattern_length + 4, sizeof(char));
-	require(NULL != hold, "temp memory allocation failed\n");
+	/* Only a temp file that was written out completely may replace the original */
+	if(0 != fflush(output)) output_failed();
+#if !defined(__M2__)
+	if(ferror(output)) output_failed();
+#endif
+	if(0 != fclose(output)) output_failed();
 
-	/* Replace it all */
-	while((size + pattern_length + 4) >= buffer_index)
+	if(NULL != temp_name)
 	{
-		read_next_byte();
-		check_match();
+		if(0 != rename(temp_name, output_name))
+		{
+			unlink(temp_name);
+			fputs("unable to replace the output file\n", stderr);
+			exit(EXIT_FAILURE);
+		}
 	}
-	fclose(output);
+
+	return 0;
 }
@@ -57,4 +57,65 @@ tar --no-recursion -cf bin/tests/check.tar bin/tests/abc bin/tests/abcd bin/test
 	../../sha256sum -c ../checks
 	ls -l bin/tests/null bin/tests/dir1/null1
 )
+(
+	rm -rf bin/tests/tar-check
+	mkdir bin/tests/tar-check
+	cd bin/tests/tar-check
+
+	../../untar --jobs 3 --file ../check.tar
+
+	../../sha256sum -c ../checks
+	ls -l bin/tests/null bin/tests/dir1/null1
+)
+(
+	# A path stored twice must end up as its last member, with or without writer threads
+	rm -rf bin/tests/dup bin/tests/tar-check
+	mkdir bin/tests/dup bin/tests/tar-check
+	cd bin/tests/dup
+	cp ../abc big
+	cp ../abc small
+	tar -cf ../dup.tar big small
+	cat ../long ../long >big
+	cp ../abcd small
+	tar -rf ../dup.tar big small
+	cd ../tar-check
+	../../untar --jobs 4 --file ../dup.tar
+	cmp big ../dup/big
+	cmp small ../dup/small
+)
+gzip -c bin/tests/check.tar >bin/tests/check.tar.gz
+bzip2 -c bin/tests/check.tar >bin/tests/check.tar.bz2
+xz -c bin/tests/check.tar >bin/tests/check.tar.xz
+for c in gz bz2 xz
+do
+	(
+		rm -rf bin/tests/tar-check
+		mkdir bin/tests/tar-check
+		cd bin/tests/tar-check
+
+		../../untar --file ../check.tar.$c
+
+		../../sha256sum -c ../checks
+	)
+done
 echo 'tar tests done'
+
+echo 'Beginning bz2 tests'
+bzip2 -c bin/tests/abc >bin/tests/multi.bz2
+bzip2 -c bin/tests/long >>bin/tests/multi.bz2
+bzip2 -c bin/tests/abcd >>bin/tests/multi.bz2
+cat bin/tests/abc bin/tests/long bin/tests/abcd >bin/tests/multi.expected
+bin/unbz2 --file bin/tests/multi.bz2 --output bin/tests/multi
+cmp bin/tests/multi bin/tests/multi.expected
+bin/unbz2 --jobs 3 --file bin/tests/multi.bz2 --output bin/tests/multi
+cmp bin/tests/multi bin/tests/multi.expected
+echo 'bz2 tests done'
+
+echo 'Beginning xz tests'
+cat bin/tests/abc bin/tests/long bin/tests/abcd bin/tests/long >bin/tests/blocks.expected
+xz -T2 --block-size=300000 -c bin/tests/blocks.expected >bin/tests/blocks.xz
+bin/unxz --file bin/tests/blocks.xz --output bin/tests/blocks
+cmp bin/tests/blocks bin/tests/blocks.expected
+bin/unxz --jobs 3 --file bin/tests/blocks.xz --output bin/tests/blocks
+cmp bin/tests/blocks bin/tests/blocks.expected
+echo 'xz tests done'
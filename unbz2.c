@@ -41,6 +41,12 @@
 #include <fcntl.h>
 #include "M2libc/bootstrappable.h"
 
+#if !defined(__M2__)
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
 // Constants for huffman coding
 #define MAX_GROUPS               6
 #define GROUP_SIZE               50     /* 64 would have been more efficient */
@@ -57,6 +63,10 @@
 #define RETVAL_NOT_BZIP_DATA     (-1)
 #define RETVAL_DATA_ERROR        (-2)
 #define RETVAL_OBSOLETE_INPUT    (-3)
+#define RETVAL_OUTPUT_FULL       (-4)
+
+// Decompressed bytes a batch of parallel jobs may hold in memory between them
+#define PARALLEL_OUT_MAX         67108864
 
 #define INT_MAX 2147483647
 
@@ -98,10 +108,29 @@ struct bunzip_data
 	unsigned inbufBitCount;
 	unsigned inbufBits;
 
+	// When in_fd < 0 the compressed data comes from memory instead and
+	// running off its end sets inbufError rather than exiting.
+	char *memIn;
+	size_t memInLen;
+	int inbufError;
+
 	// Output buffer
 	char *outbuf;
 	int outbufPos;
 
+	// When out_fd < 0 the output is collected here instead, up to
+	// memOutMax bytes; past that memOutFull is set and decoding stops.
+	char *memOut;
+	size_t memOutLen;
+	size_t memOutSize;
+	size_t memOutMax;
+	int memOutFull;
+
+	// Otherwise the first outSkip bytes are dropped, as they were written
+	// out before, and outWritten counts the rest.
+	size_t outSkip;
+	size_t outWritten;
+
 	unsigned totalCRC;
 
 	// First pass decompression data (Huffman and MTF decoding)
@@ -182,6 +211,35 @@ void crc_init(unsigned *crc_table, int little_endian)
 	}
 }
 
+// Refill the input buffer, returns the number of bytes now available in it.
+int fill_bunzip_inbuf(struct bunzip_data *bd)
+{
+	size_t n;
+
+	if(bd->in_fd >= 0)
+	{
+		bd->inbufCount = read(bd->in_fd, bd->inbuf, IOBUF_SIZE);
+	}
+	else
+	{
+		// Hand out the in-memory input in place, IOBUF_SIZE bytes at a time
+		n = bd->memInLen;
+
+		if(n > IOBUF_SIZE)
+		{
+			n = IOBUF_SIZE;
+		}
+
+		bd->inbuf = bd->memIn;
+		bd->inbufCount = n;
+		bd->memIn = bd->memIn + n;
+		bd->memInLen = bd->memInLen - n;
+	}
+
+	bd->inbufPos = 0;
+	return bd->inbufCount;
+}
+
 // Return the next nnn bits of input.  All reads from the compressed input
 // are done through this function.  All reads are big endian.
 unsigned get_bits(struct bunzip_data *bd, char bits_wanted)
@@ -195,12 +253,16 @@ unsigned get_bits(struct bunzip_data *bd, char bits_wanted)
 		// If we need to read more data from file into byte buffer, do so
 		if(bd->inbufPos == bd->inbufCount)
 		{
-			if(0 >= (bd->inbufCount = read(bd->in_fd, bd->inbuf, IOBUF_SIZE)))
+			if(0 >= fill_bunzip_inbuf(bd))
 			{
-				exit(1);
-			}
+				if(bd->in_fd >= 0)
+				{
+					exit(1);
+				}
 
-			bd->inbufPos = 0;
+				bd->inbufError = TRUE;
+				return 0;
+			}
 		}
 
 		// Avoid 32-bit overflow (dump bit buffer to top of output)
@@ -706,14 +768,59 @@ int read_huffman_data(struct bunzip_data *bd, struct bwdata *bw)
 	return 0;
 }
 
-// Flush output buffer to disk
+// Flush output buffer to disk (or to memOut if out_fd < 0)
 void flush_bunzip_outbuf(struct bunzip_data *bd, int out_fd)
 {
-	if(bd->outbufPos)
+	char *out = bd->outbuf;
+	int n = bd->outbufPos;
+
+	if(n)
 	{
-		if(write(out_fd, bd->outbuf, bd->outbufPos) != bd->outbufPos)
+		if(out_fd < 0)
 		{
-			exit(1);
+			if(bd->memOutFull || bd->memOutLen + n > bd->memOutMax)
+			{
+				bd->memOutFull = TRUE;
+			}
+			else
+			{
+				if(bd->memOutLen + n > bd->memOutSize)
+				{
+					bd->memOutSize = (2 * bd->memOutSize) + n;
+
+					if(bd->memOutSize > bd->memOutMax)
+					{
+						bd->memOutSize = bd->memOutMax;
+					}
+
+					bd->memOut = realloc(bd->memOut, bd->memOutSize);
+					require(NULL != bd->memOut, "Unable to grow the output buffer\n");
+				}
+
+				memcpy(bd->memOut + bd->memOutLen, out, n);
+				bd->memOutLen = bd->memOutLen + n;
+			}
+		}
+		else
+		{
+			if(bd->outSkip >= n)
+			{
+				bd->outSkip = bd->outSkip - n;
+				n = 0;
+			}
+			else
+			{
+				out = out + bd->outSkip;
+				n = n - bd->outSkip;
+				bd->outSkip = 0;
+			}
+
+			if(n && write(out_fd, out, n) != n)
+			{
+				exit(1);
+			}
+
+			bd->outWritten = bd->outWritten + n;
 		}
 
 		bd->outbufPos = 0;
@@ -775,6 +882,12 @@ int read_bunzip_data(struct bunzip_data *bd)
 		rc = read_huffman_data(bd, bd->bwdata);
 	}
 
+	// Ran off the end of in-memory input
+	if(bd->inbufError)
+	{
+		rc = RETVAL_DATA_ERROR;
+	}
+
 	// First thing that can be done by a background thread.
 	burrows_wheeler_prep(bd, bd->bwdata);
 	return rc;
@@ -814,6 +927,12 @@ int write_bunzip_data(struct bunzip_data *bd, struct bwdata *bw,
 		// If we need to refill dbuf, do it.
 		if(!bw->writeCount)
 		{
+			// Out of room in memOut, the caller decodes this piece again
+			if(bd->memOutFull)
+			{
+				return RETVAL_OUTPUT_FULL;
+			}
+
 			i = read_bunzip_data(bd);
 
 			if(i)
@@ -939,19 +1058,24 @@ dataus_interruptus:
 	}
 }
 
-// Allocate the structure, read file header. If !len, src_fd contains
-// filehandle to read from. Else inbuf contains data.
-int start_bunzip(struct bunzip_data **bdp, int src_fd)
+// Allocate the structure.  If src_fd < 0 the caller hands over the compressed
+// data through memIn/memInLen instead.
+struct bunzip_data *start_bunzip(int src_fd)
 {
 	struct bunzip_data *bd;
 	unsigned i;
 	// Figure out how much data to allocate.
 	i = sizeof(struct bunzip_data);
 	// Allocate bunzip_data. Most fields initialize to zero.
-	*bdp = malloc(i);
-	bd = *bdp;
+	bd = malloc(i);
+	require(NULL != bd, "Unable to allocate bunzip_data\n");
 	memset(bd, 0, i);
-	bd->inbuf = calloc(IOBUF_SIZE, sizeof(char));
+
+	if(src_fd >= 0)
+	{
+		bd->inbuf = calloc(IOBUF_SIZE, sizeof(char));
+	}
+
 	bd->outbuf = calloc(IOBUF_SIZE, sizeof(char));
 	bd->selectors = calloc(32768, sizeof(char));
 	bd->groups = calloc(MAX_GROUPS, sizeof(struct group_data));
@@ -968,10 +1092,17 @@ int start_bunzip(struct bunzip_data **bdp, int src_fd)
 	bd->crc32Table = calloc(256, sizeof(unsigned));
 	bd->bwdata = calloc(1, sizeof(struct bwdata));
 	bd->bwdata->byteCount = calloc(256, sizeof(int));
-	unsigned *crc32Table;
 	bd->in_fd = src_fd;
 	crc_init(bd->crc32Table, 0);
-	// Ensure that file starts with "BZh".
+	return bd;
+}
+
+// Read the file header that starts every bzip2 stream and size the
+// intermediate buffer for its block size.
+int read_stream_header(struct bunzip_data *bd)
+{
+	unsigned i;
+	// Ensure that the stream starts with "BZh".
 	char *header = "BZh";
 
 	for(i = 0; i < 3; i += 1) if(get_bits(bd, 8) != header[i])
@@ -988,39 +1119,30 @@ int start_bunzip(struct bunzip_data **bdp, int src_fd)
 		return RETVAL_NOT_BZIP_DATA;
 	}
 
-	bd->dbufSize = 100000 * (i - 48);
-	bd->bwdata[0].dbuf = malloc(bd->dbufSize * sizeof(int));
+	if(bd->dbufSize != 100000 * (i - 48))
+	{
+		free(bd->bwdata[0].dbuf);
+		bd->dbufSize = 100000 * (i - 48);
+		bd->bwdata[0].dbuf = malloc(bd->dbufSize * sizeof(int));
+		require(NULL != bd->bwdata[0].dbuf, "Unable to allocate the block buffer\n");
+	}
+
+	// Each stream carries its own combined CRC
+	bd->totalCRC = 0;
+	bd->bwdata[0].writeCount = 0;
 	return 0;
 }
 
-// Example usage: decompress src_fd to dst_fd. (Stops at end of bzip data,
-// not end of file.)
-int bunzipStream(int src_fd, int dst_fd)
+void free_bunzip(struct bunzip_data *bd)
 {
-	struct bunzip_data *bd;
-	int i;
 	int j;
+	free(bd->bwdata[0].dbuf);
 
-	if(!(i = start_bunzip(&bd, src_fd)))
+	if(bd->in_fd >= 0)
 	{
-		i = write_bunzip_data(bd, bd->bwdata, dst_fd, 0, 0);
-
-		if(i == RETVAL_LAST_BLOCK)
-		{
-			if(bd->bwdata[0].headerCRC == bd->totalCRC)
-			{
-				i = 0;
-			}
-			else
-			{
-				i = RETVAL_DATA_ERROR;
-			}
-		}
+		free(bd->inbuf);
 	}
 
-	flush_bunzip_outbuf(bd, dst_fd);
-	free(bd->bwdata[0].dbuf);
-	free(bd->inbuf);
 	free(bd->outbuf);
 	free(bd->selectors);
 
@@ -1038,12 +1160,297 @@ int bunzipStream(int src_fd, int dst_fd)
 	free(bd->bwdata->byteCount);
 	free(bd->bwdata);
 	free(bd);
+}
+
+// Decompress every stream in the input to dst_fd, one after the other.
+// pbzip2 and friends write files made of many concatenated streams.
+int bunzip_streams(struct bunzip_data *bd, int dst_fd)
+{
+	int i = read_stream_header(bd);
+
+	while(!i)
+	{
+		i = write_bunzip_data(bd, bd->bwdata, dst_fd, 0, 0);
+
+		// Clean end of stream, check the combined CRC of its blocks.
+		// A block CRC failure shows up as a premature RETVAL_LAST_BLOCK.
+		if(!i && (bd->bwdata[0].headerCRC != bd->totalCRC || bd->inbufError))
+		{
+			i = RETVAL_DATA_ERROR;
+		}
+
+		if(i == RETVAL_LAST_BLOCK)
+		{
+			i = RETVAL_DATA_ERROR;
+		}
+
+		if(i)
+		{
+			break;
+		}
+
+		// Streams end on a byte boundary, drop the padding bits and see if
+		// another one follows.
+		bd->inbufBitCount = 0;
+
+		if(bd->inbufPos == bd->inbufCount)
+		{
+			if(0 >= fill_bunzip_inbuf(bd))
+			{
+				break;
+			}
+		}
+
+		i = read_stream_header(bd);
+
+		if(i == RETVAL_NOT_BZIP_DATA)
+		{
+			fputs("Ignoring trailing garbage after bzip2 data\n", stderr);
+			i = 0;
+			break;
+		}
+	}
+
+	flush_bunzip_outbuf(bd, dst_fd);
+	return i;
+}
+
+void write_all(int fd, char *buf, size_t len)
+{
+	int r;
+
+	while(len > 0)
+	{
+		r = write(fd, buf, len);
+
+		if(r <= 0)
+		{
+			exit(1);
+		}
+
+		buf = buf + r;
+		len = len - r;
+	}
+}
+
+#if !defined(__M2__)
+// A run of whole streams decompressed into memory on its own thread, up to
+// outMax bytes of output
+struct bunzip_job
+{
+	pthread_t thread;
+	char *in;
+	size_t inLen;
+	size_t outMax;
+	struct bunzip_data *bd;
+	int rc;
+};
+
+void *bunzip_job_run(void *arg)
+{
+	struct bunzip_job *job = arg;
+	job->bd = start_bunzip(-1);
+	job->bd->memIn = job->in;
+	job->bd->memInLen = job->inLen;
+	job->bd->memOutMax = job->outMax;
+	job->rc = bunzip_streams(job->bd, -1);
+	return NULL;
+}
+
+// Streams start byte aligned with "BZh", the block size digit and then the
+// magic of the first block, or of the end of stream marker if it is empty.
+int is_stream_start(char *p, size_t n)
+{
+	if(n < 10 || p[3] < '1' || p[3] > '9' || 0 != memcmp(p, "BZh", 3))
+	{
+		return FALSE;
+	}
+
+	if(0 == memcmp(p + 4, "\x31\x41\x59\x26\x53\x59", 6))
+	{
+		return TRUE;
+	}
+
+	return 0 == memcmp(p + 4, "\x17\x72\x45\x38\x50\x90", 6);
+}
+
+// Offset of the next stream start after start, or len if there is none.
+size_t next_stream_start(char *data, size_t len, size_t start)
+{
+	char *hit;
+	size_t next = start + 1;
+
+	while(next < len)
+	{
+		hit = memchr(data + next, 'B', len - next);
+
+		if(NULL == hit)
+		{
+			return len;
+		}
+
+		next = hit - data;
+
+		if(is_stream_start(hit, len - next))
+		{
+			return next;
+		}
+
+		next = next + 1;
+	}
+
+	return len;
+}
+
+// Decompress in-memory input straight to dst_fd on this thread, dropping
+// the first skip bytes of output.  Sets *written to the bytes it wrote.
+int bunzip_memory(char *in, size_t len, int dst_fd, size_t skip, size_t *written)
+{
+	struct bunzip_data *bd = start_bunzip(-1);
+	int rc;
+	bd->memIn = in;
+	bd->memInLen = len;
+	bd->outSkip = skip;
+	rc = bunzip_streams(bd, dst_fd);
+	*written = bd->outWritten;
+	free_bunzip(bd);
+	return rc;
+}
+
+// Decompress the piece at in straight to dst_fd, the first skip bytes of
+// its output being out already.  Should the piece not decode on its own,
+// everything from it to end is decoded serially instead, carrying on after
+// what was written, and *done is set.
+int bunzip_piece(char *in, size_t len, char *end, int dst_fd, size_t skip, int *done)
+{
+	size_t written;
+	int rc = bunzip_memory(in, len, dst_fd, skip, &written);
+
+	if(0 != rc)
+	{
+		if((size_t)(end - in) > len)
+		{
+			rc = bunzip_memory(in, end - in, dst_fd, skip + written, &written);
+		}
+
+		*done = TRUE;
+	}
+
+	return rc;
+}
+
+// Decompress the concatenated streams of a mapped file on up to threads
+// threads at once and write their output in order.  Stream boundaries are
+// found by their signature; should one turn up inside compressed data by
+// chance its piece fails to decode, and from there on everything is decoded
+// serially instead.  The first piece of each batch is written out as it is
+// decoded; the others are held in memory up to PARALLEL_OUT_MAX bytes
+// between them, and a piece that outgrows its share finishes decoding
+// straight to dst_fd once its turn comes.
+int bunzip_parallel(char *data, size_t len, int dst_fd, int threads)
+{
+	struct bunzip_job *jobs = calloc(threads, sizeof(struct bunzip_job));
+	size_t start = 0;
+	size_t next;
+	int count;
+	int i;
+	int rc = 0;
+	int done = FALSE;
+	require(NULL != jobs, "Unable to allocate the decompression jobs\n");
+
+	while(!done && start < len)
+	{
+		// Cut the next batch of pieces, each running up to the next stream
+		for(count = 0; count < threads && start < len; count += 1)
+		{
+			next = next_stream_start(data, len, start);
+			jobs[count].in = data + start;
+			jobs[count].inLen = next - start;
+			start = next;
+		}
+
+		for(i = 1; i < count; i += 1)
+		{
+			jobs[i].outMax = PARALLEL_OUT_MAX / (count - 1);
+
+			if(0 != pthread_create(&jobs[i].thread, NULL, bunzip_job_run, jobs + i))
+			{
+				jobs[i].thread = pthread_self();
+				bunzip_job_run(jobs + i);
+			}
+		}
+
+		// The head of the batch needs no buffering, decode it meanwhile
+		rc = bunzip_piece(jobs[0].in, jobs[0].inLen, data + len, dst_fd, 0, &done);
+
+		for(i = 1; i < count; i += 1)
+		{
+			if(!pthread_equal(jobs[i].thread, pthread_self()))
+			{
+				pthread_join(jobs[i].thread, NULL);
+			}
+
+			if(done)
+			{
+				// Already covered by the serial fallback
+			}
+			else if(0 == jobs[i].rc)
+			{
+				write_all(dst_fd, jobs[i].bd->memOut, jobs[i].bd->memOutLen);
+			}
+			else if(RETVAL_OUTPUT_FULL == jobs[i].rc)
+			{
+				write_all(dst_fd, jobs[i].bd->memOut, jobs[i].bd->memOutLen);
+				rc = bunzip_piece(jobs[i].in, jobs[i].inLen, data + len, dst_fd, jobs[i].bd->memOutLen, &done);
+			}
+			else
+			{
+				rc = bunzip_piece(jobs[i].in, (data + len) - jobs[i].in, data + len, dst_fd, 0, &done);
+				done = TRUE;
+			}
+
+			free(jobs[i].bd->memOut);
+			free_bunzip(jobs[i].bd);
+		}
+	}
+
+	free(jobs);
+	return rc;
+}
+#endif
+
+// Example usage: decompress src_fd to dst_fd, including any concatenated
+// streams, using up to threads threads where possible.
+int bunzipStream(int src_fd, int dst_fd, int threads)
+{
+	struct bunzip_data *bd;
+	int i;
+#if !defined(__M2__)
+	struct stat st;
+	char *data;
+
+	if(threads > 1 && 0 == fstat(src_fd, &st) && S_ISREG(st.st_mode) && st.st_size > 0)
+	{
+		data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, src_fd, 0);
+
+		if(MAP_FAILED != data)
+		{
+			i = bunzip_parallel(data, st.st_size, dst_fd, threads);
+			munmap(data, st.st_size);
+			return -i;
+		}
+	}
+#endif
+
+	bd = start_bunzip(src_fd);
+	i = bunzip_streams(bd, dst_fd);
+	free_bunzip(bd);
 	return -i;
 }
 
-void do_bunzip2(int in_fd, int out_fd)
+void do_bunzip2(int in_fd, int out_fd, int threads)
 {
-	int err = bunzipStream(in_fd, out_fd);
+	int err = bunzipStream(in_fd, out_fd, threads);
 
 	if(err)
 	{
@@ -1056,6 +1463,11 @@ int main(int argc, char **argv)
 	char *name = NULL;
 	char *dest = NULL;
 	FUZZING = FALSE;
+#if defined(__M2__)
+	int threads = 1;
+#else
+	int threads = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
 
 	/* process arguments */
 	int i = 1;
@@ -1078,6 +1490,13 @@ int main(int argc, char **argv)
 			require(NULL != dest, "the --output option requires a filename to be given\n");
 			i += 2;
 		}
+		else if(match(argv[i], "-j") || match(argv[i], "--jobs"))
+		{
+			require(NULL != argv[i + 1], "the --jobs option requires a number to be given\n");
+			threads = strtoint(argv[i + 1]);
+			require(threads > 0, "the --jobs option requires a positive number\n");
+			i += 2;
+		}
 		else if(match(argv[i], "--fuzzing-mode"))
 		{
 			FUZZING = TRUE;
@@ -1089,6 +1508,7 @@ int main(int argc, char **argv)
 			fputs(argv[0], stderr);
 			fputs(" --file $input.bz2", stderr);
 			fputs(" --output $output\n", stderr);
+			fputs("--jobs $n to decompress up to n concatenated streams at once\n", stderr);
 			fputs("--help to get this message\n", stderr);
 			exit(EXIT_SUCCESS);
 		}
@@ -1146,7 +1566,7 @@ int main(int argc, char **argv)
 		exit(EXIT_FAILURE);
 	}
 
-	do_bunzip2(in_fd, out_fd);
+	do_bunzip2(in_fd, out_fd, threads);
 	close(in_fd);
 	close(out_fd);
 	exit(0);
@@ -51,9 +51,57 @@
 #include <sys/stat.h>  /* For mkdir() */
 #include "M2libc/bootstrappable.h"
 
+#if !defined(__M2__)
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+#include <sys/wait.h>
+#endif
+
+/* Longest path of untar itself that sibling_path takes. */
+#define MAX_PATH_LEN 4096
+/* Member data moves in chunks of this many bytes, a multiple of 512. */
+#define CHUNK_SIZE 65536
+/* With --jobs, files up to this size are handed to the writer threads. */
+#define QUEUE_FILE_MAX 1048576
+/* The reader waits while this many bytes of file data are queued. */
+#define QUEUE_BYTES_MAX 67108864
+
 int FUZZING;
 int VERBOSE;
 int STRICT;
+int JOBS;
+
+#if !defined(__M2__)
+/* A file for a writer thread to create, or a symlink to create at the end. */
+struct extract_job
+{
+	char* name;
+	char* data;  /* The file contents, or the symlink target. */
+	size_t size;
+	struct extract_job* next;
+};
+
+/* The queue between the archive reader and one writer thread. */
+struct extract_queue
+{
+	struct extract_job* head;
+	struct extract_job* tail;
+	pthread_cond_t filled;
+};
+
+/* One queue per writer; a name always hashes to the same writer, so when an
+ * archive holds a path twice the later member is still written last.
+ */
+pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t queue_drained = PTHREAD_COND_INITIALIZER;
+struct extract_queue* queues;
+size_t queue_bytes;
+int queue_jobs;  /* Files queued or being written. */
+int queue_closed;
+/* Held while creating directories, so threads don't race on the same parent. */
+pthread_mutex_t dir_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
 
 /* Parse an octal number, ignoring leading and trailing nonsense. */
 int parseoct(char const* p, size_t n)
@@ -95,6 +143,65 @@ int is_end_of_archive(char const* p)
 	return TRUE;
 }
 
+/* Directories this run has created, hashed by path, so creating the parents
+ * of a path stops at the first one already made instead of failing a mkdir
+ * for every level.
+ */
+#define DIR_CACHE_SIZE 4096
+
+struct dir_entry
+{
+	char* path;
+	struct dir_entry* next;
+};
+
+struct dir_entry** dir_cache;
+
+int dir_hash(char* path)
+{
+	int h = 5381;
+
+	while(0 != path[0])
+	{
+		h = ((h << 5) + h + (0xFF & path[0])) & 0xFFFFFF;
+		path = path + 1;
+	}
+
+	return h % DIR_CACHE_SIZE;
+}
+
+int dir_cached(char* path)
+{
+	struct dir_entry* e;
+	if(NULL == dir_cache) return FALSE;
+
+	for(e = dir_cache[dir_hash(path)]; NULL != e; e = e->next)
+	{
+		if(match(e->path, path)) return TRUE;
+	}
+
+	return FALSE;
+}
+
+void cache_dir(char* path)
+{
+	struct dir_entry* e = calloc(1, sizeof(struct dir_entry));
+	int h = dir_hash(path);
+	require(NULL != e, "failed to allocate the directory cache\n");
+
+	if(NULL == dir_cache)
+	{
+		dir_cache = calloc(DIR_CACHE_SIZE, sizeof(struct dir_entry*));
+		require(NULL != dir_cache, "failed to allocate the directory cache\n");
+	}
+
+	e->path = calloc(strlen(path) + 1, sizeof(char));
+	require(NULL != e->path, "failed to allocate the directory cache\n");
+	strcpy(e->path, path);
+	e->next = dir_cache[h];
+	dir_cache[h] = e;
+}
+
 /* Create a directory, including parent directories as necessary. */
 void create_dir(char *pathname, int mode)
 {
@@ -108,7 +215,7 @@ void create_dir(char *pathname, int mode)
 	}
 
 	/* Try creating the directory. */
-	if(!FUZZING)
+	if(!FUZZING && !dir_cached(pathname))
 	{
 		r = mkdir(pathname, mode);
 
@@ -120,9 +227,14 @@ void create_dir(char *pathname, int mode)
 			if(p != NULL)
 			{
 				p[0] = '\0';
-				create_dir(pathname, 0755);
+				/* If we made the parent, creating it again won't help. */
+				if(!dir_cached(pathname))
+				{
+					create_dir(pathname, 0755);
+					p[0] = '/';
+					r = mkdir(pathname, mode);
+				}
 				p[0] = '/';
-				r = mkdir(pathname, mode);
 			}
 		}
 
@@ -132,6 +244,7 @@ void create_dir(char *pathname, int mode)
 			fputs(pathname, stderr);
 			fputc('\n', stderr);
 		}
+		else cache_dir(pathname);
 	}
 }
 
@@ -149,16 +262,40 @@ FILE* create_file(char *pathname)
 
 		if(p != NULL)
 		{
+#if !defined(__M2__)
+			pthread_mutex_lock(&dir_lock);
+			/* Another writer thread may have just created it. */
+			f = fopen(pathname, "w");
+			if(f == NULL)
+			{
+#endif
 			p[0] = '\0';
 			create_dir(pathname, 0755);
 			p[0] = '/';
 			f = fopen(pathname, "w");
+#if !defined(__M2__)
+			}
+			pthread_mutex_unlock(&dir_lock);
+#endif
 		}
 	}
 
 	return f;
 }
 
+#if !defined(__M2__)
+/* Copies up to n bytes of the archive at offset off[0] straight into the
+ * file out inside the kernel, advancing off[0]. Returns how many bytes
+ * were copied, or -1 if neither copy_file_range nor sendfile can do it.
+ */
+ssize_t copy_range(int in, off_t* off, int out, size_t n)
+{
+	ssize_t r = copy_file_range(in, off, out, NULL, n, 0);
+	if(r < 0) r = sendfile(out, in, off, n);
+	return r;
+}
+#endif
+
 /* Verify the tar checksum. */
 int verify_checksum(char const* p)
 {
@@ -185,17 +322,108 @@ int verify_checksum(char const* p)
 	return (u == r);
 }
 
+#if !defined(__M2__)
+/* Creates and writes the files on its queue until that is closed and empty. */
+void* extract_worker(void* arg)
+{
+	struct extract_queue* q = arg;
+	struct extract_job* job;
+	FILE* f;
+
+	while(TRUE)
+	{
+		pthread_mutex_lock(&queue_lock);
+		while((NULL == q->head) && !queue_closed) pthread_cond_wait(&q->filled, &queue_lock);
+		job = q->head;
+		if(NULL != job)
+		{
+			q->head = job->next;
+			if(NULL == q->head) q->tail = NULL;
+		}
+		pthread_mutex_unlock(&queue_lock);
+		if(NULL == job) return NULL;
+
+		f = create_file(job->name);
+		if(NULL == f)
+		{
+			fputs("Unable to create ", stderr);
+			fputs(job->name, stderr);
+			fputc('\n', stderr);
+		}
+		else
+		{
+			if(fwrite(job->data, 1, job->size, f) != job->size) fputs("Failed write\n", stderr);
+			fclose(f);
+		}
+
+		pthread_mutex_lock(&queue_lock);
+		queue_bytes = queue_bytes - job->size;
+		queue_jobs = queue_jobs - 1;
+		pthread_cond_signal(&queue_drained);
+		pthread_mutex_unlock(&queue_lock);
+		free(job->name);
+		free(job->data);
+		free(job);
+	}
+}
+
+/* Hands a file to its writer thread, waiting while too much data is queued. */
+void queue_file(char* name, char* data, size_t size)
+{
+	struct extract_queue* q = queues + (dir_hash(name) % JOBS);
+	struct extract_job* job = calloc(1, sizeof(struct extract_job));
+	require(NULL != job, "failed to allocate a file for the writer threads\n");
+	job->name = strdup(name);
+	job->data = data;
+	job->size = size;
+
+	pthread_mutex_lock(&queue_lock);
+	while((queue_bytes > 0) && (queue_bytes + size > QUEUE_BYTES_MAX)) pthread_cond_wait(&queue_drained, &queue_lock);
+	queue_bytes = queue_bytes + size;
+	queue_jobs = queue_jobs + 1;
+	if(NULL == q->tail) q->head = job;
+	else q->tail->next = job;
+	q->tail = job;
+	pthread_cond_signal(&q->filled);
+	pthread_mutex_unlock(&queue_lock);
+}
+
+/* Waits for the writer threads to finish what is queued, so a file the
+ * reader writes itself can't be overwritten by an earlier member of the same name.
+ */
+void drain_queue()
+{
+	if(NULL == queues) return;
+	pthread_mutex_lock(&queue_lock);
+	while(queue_jobs > 0) pthread_cond_wait(&queue_drained, &queue_lock);
+	pthread_mutex_unlock(&queue_lock);
+}
+#endif
+
 /* Extract a tar archive. */
-int untar(FILE *a, char const* path)
+int untar_records(FILE *a, char const* path, void* symlinks)
 {
 	char* target = calloc(101, sizeof(char));
 	char* buff = calloc(514, sizeof(char));
+	char* data = calloc(CHUNK_SIZE, sizeof(char));
+	char* contents;
 	FILE* f = NULL;
 	size_t bytes_read;
 	size_t bytes_written;
 	int symlink_ret;
 	int filesize;
+	int padded;
+	int chunk;
 	int op;
+#if !defined(__M2__)
+	struct stat st;
+	off_t off;
+	ssize_t copied;
+	struct extract_job** deferred = symlinks;
+	struct extract_job* link;
+	/* Only a regular file can have member data copied by offset. */
+	int seekable = (0 == fstat(fileno(a), &st)) && S_ISREG(st.st_mode);
+#endif
 	if(VERBOSE)
 	{
 		fputs("Extracting from ", stdout);
@@ -264,6 +492,19 @@ int untar(FILE *a, char const* path)
 				fputs(" Extracting file ", stdout);
 				puts(buff);
 			}
+#if !defined(__M2__)
+			/* With writer threads, symlinks wait until every file is written. */
+			if((JOBS > 1) && !FUZZING)
+			{
+				link = calloc(1, sizeof(struct extract_job));
+				require(NULL != link, "failed to allocate a symlink\n");
+				link->name = strdup(buff);
+				link->data = strdup(target);
+				link->next = deferred[0];
+				deferred[0] = link;
+			}
+			else
+#endif
 			if(!FUZZING) {
 				symlink_ret = symlink(target, buff);
 				if (symlink_ret != 0) {
@@ -299,7 +540,13 @@ int untar(FILE *a, char const* path)
 				fputs(" Extracting dir ", stdout);
 				puts(buff);
 			}
+#if !defined(__M2__)
+			pthread_mutex_lock(&dir_lock);
+#endif
 			create_dir(buff, parseoct(buff + 100, 8));
+#if !defined(__M2__)
+			pthread_mutex_unlock(&dir_lock);
+#endif
 			filesize = 0;
 		}
 		else if('6' == op)
@@ -319,32 +566,80 @@ int untar(FILE *a, char const* path)
 				fputs(" Extracting file ", stdout);
 				puts(buff);
 			}
+#if !defined(__M2__)
+			if((JOBS > 1) && !FUZZING && (filesize <= QUEUE_FILE_MAX))
+			{
+				/* Read the whole record run, the writer threads do the rest. */
+				padded = (filesize + 511) & ~511;
+				contents = malloc(padded + 1);
+				require(NULL != contents, "failed to allocate a file for the writer threads\n");
+				bytes_read = fread(contents, 1, padded, a);
+				if(bytes_read < (size_t)padded)
+				{
+					fputs("Short read on ", stderr);
+					fputs(path, stderr);
+					fputs(": Expected ", stderr);
+					fputs(int2str(padded, 10, TRUE), stderr);
+					fputs(", got ", stderr);
+					puts(int2str(bytes_read, 10, TRUE));
+					free(contents);
+					return FALSE;
+				}
+				queue_file(buff, contents, filesize);
+				continue;
+			}
+			drain_queue();
+#endif
 			f = create_file(buff);
 		}
 
-		while(filesize > 0)
+		/* The data is padded to whole 512 byte records. */
+		padded = (filesize + 511) & ~511;
+
+#if !defined(__M2__)
+		if(seekable && (f != NULL) && !FUZZING)
+		{
+			off = ftell(a);
+			while(filesize > 0)
+			{
+				copied = copy_range(fileno(a), &off, fileno(f), filesize);
+				if(copied <= 0) break;
+				filesize = filesize - copied;
+				padded = padded - copied;
+			}
+
+			/* Whatever is left, if anything, goes through the buffered loop below. */
+			fseek(a, off, SEEK_SET);
+		}
+#endif
+
+		while(padded > 0)
 		{
-			bytes_read = fread(buff, 1, 512, a);
+			chunk = CHUNK_SIZE;
+			if(padded < chunk) chunk = padded;
+			bytes_read = fread(data, 1, chunk, a);
 
-			if(bytes_read < 512)
+			if(bytes_read < (size_t)chunk)
 			{
 				fputs("Short read on ", stderr);
 				fputs(path, stderr);
-				fputs(": Expected 512, got ", stderr);
+				fputs(": Expected ", stderr);
+				fputs(int2str(chunk, 10, TRUE), stderr);
+				fputs(", got ", stderr);
 				puts(int2str(bytes_read, 10, TRUE));
 				return FALSE;
 			}
 
-			if(filesize < 512)
+			if(filesize < chunk)
 			{
 				bytes_read = filesize;
 			}
 
-			if(f != NULL)
+			if((f != NULL) && (bytes_read > 0))
 			{
 				if(!FUZZING)
 				{
-					bytes_written = fwrite(buff, 1, bytes_read, f);
+					bytes_written = fwrite(data, 1, bytes_read, f);
 					if(bytes_written != bytes_read)
 					{
 						fputs("Failed write\n", stderr);
@@ -355,6 +650,7 @@ int untar(FILE *a, char const* path)
 			}
 
 			filesize = filesize - bytes_read;
+			padded = padded - chunk;
 		}
 
 		if(f != NULL)
@@ -366,19 +662,185 @@ int untar(FILE *a, char const* path)
 	return TRUE;
 }
 
+/* Extract a tar archive, with JOBS writer threads if JOBS > 1. */
+int untar(FILE *a, char const* path)
+{
+#if defined(__M2__)
+	return untar_records(a, path, NULL);
+#else
+	pthread_t* workers;
+	struct extract_job* symlinks = NULL;
+	struct extract_job* link;
+	int r;
+	int i;
+
+	if(JOBS < 2) return untar_records(a, path, &symlinks);
+
+	workers = calloc(JOBS, sizeof(pthread_t));
+	queues = calloc(JOBS, sizeof(struct extract_queue));
+	require((NULL != workers) && (NULL != queues), "failed to allocate the writer threads\n");
+	queue_closed = FALSE;
+	for(i = 0; i < JOBS; i = i + 1)
+	{
+		pthread_cond_init(&queues[i].filled, NULL);
+		require(0 == pthread_create(workers + i, NULL, extract_worker, queues + i), "Unable to start a writer thread\n");
+	}
+
+	r = untar_records(a, path, &symlinks);
+
+	pthread_mutex_lock(&queue_lock);
+	queue_closed = TRUE;
+	for(i = 0; i < JOBS; i = i + 1) pthread_cond_signal(&queues[i].filled);
+	pthread_mutex_unlock(&queue_lock);
+	for(i = 0; i < JOBS; i = i + 1)
+	{
+		pthread_join(workers[i], NULL);
+		pthread_cond_destroy(&queues[i].filled);
+	}
+	free(workers);
+	free(queues);
+	queues = NULL;
+
+	/* Every file exists now, so no symlink can redirect one of them. */
+	while(NULL != symlinks)
+	{
+		link = symlinks;
+		if(0 != symlink(link->data, link->name))
+		{
+			fputs("Failed to create symlink\n", stderr);
+			if(STRICT) exit(EXIT_FAILURE);
+		}
+		symlinks = link->next;
+		free(link->name);
+		free(link->data);
+		free(link);
+	}
+
+	return r;
+#endif
+}
+
 struct files_queue
 {
 	char* name;
 	FILE* f;
+	int pid;  /* The decompressor feeding f, or 0 for a plain tar file. */
 	struct files_queue* next;
 };
 
+/* Returns the tool that decompresses f by its magic bytes, or NULL for a plain tar. */
+char* decompressor_for(FILE* f)
+{
+	char* magic = calloc(7, sizeof(char));
+	size_t n = fread(magic, sizeof(char), 6, f);
+	char* r = NULL;
+	fseek(f, 0, SEEK_SET);
+
+	if((n >= 2) && (0x1F == (0xFF & magic[0])) && (0x8B == (0xFF & magic[1]))) r = "ungz";
+	else if((n >= 3) && (0 == memcmp(magic, "BZh", 3))) r = "unbz2";
+	else if((n >= 6) && (0 == memcmp(magic, "\xFD""7zXZ\0", 6))) r = "unxz";
+
+	free(magic);
+	return r;
+}
+
+#if !defined(__M2__)
+/* Returns the path of tool in the directory untar itself is in. Only that
+ * copy is run: another program of the same name on $PATH (xz-utils ships an
+ * unxz) doesn't take our options.
+ */
+char* sibling_path(char* argv0, char* tool)
+{
+	char* self = calloc(MAX_PATH_LEN + 1, sizeof(char));
+	require(NULL != self, "failed to allocate the decompressor path\n");
+	char* path;
+	char* slash;
+	int n = readlink("/proc/self/exe", self, MAX_PATH_LEN);
+
+	if(0 < n) self[n] = 0;
+	else strncpy(self, argv0, MAX_PATH_LEN);
+
+	slash = strrchr(self, '/');
+	if(NULL == slash)
+	{
+		fputs("Unable to find the directory of ", stderr);
+		fputs(argv0, stderr);
+		fputs(" to run ", stderr);
+		fputs(tool, stderr);
+		fputc('\n', stderr);
+		exit(EXIT_FAILURE);
+	}
+
+	path = calloc((slash - self) + strlen(tool) + 2, sizeof(char));
+	require(NULL != path, "failed to allocate the decompressor path\n");
+	memcpy(path, self, (slash - self) + 1);
+	strcat(path, tool);
+	free(self);
+	return path;
+}
+
+/* Runs tool, from the directory untar is in, on name and returns the read
+ * end of a pipe carrying the decompressed tar. Decompression and extraction
+ * run side by side and no temporary .tar is written.
+ */
+FILE* open_decompressor(char* argv0, char* tool, char* name, int* pid)
+{
+	int fds[2];
+	char* path = sibling_path(argv0, tool);
+	char** args = calloc(6, sizeof(char*));
+	require(NULL != args, "failed to allocate the decompressor arguments\n");
+
+	if(0 != access(path, X_OK))
+	{
+		fputs("Unable to find ", stderr);
+		fputs(path, stderr);
+		fputs(", which is needed to extract ", stderr);
+		fputs(name, stderr);
+		fputc('\n', stderr);
+		exit(EXIT_FAILURE);
+	}
+
+	args[0] = path;
+	args[1] = "--file";
+	args[2] = name;
+	args[3] = "--output";
+	args[4] = "/dev/stdout";
+
+	require(0 == pipe(fds), "Unable to create a pipe for the decompressor\n");
+	pid[0] = fork();
+	require(pid[0] >= 0, "Unable to start the decompressor\n");
+
+	if(0 == pid[0])
+	{
+		dup2(fds[1], STDOUT_FILENO);
+		close(fds[0]);
+		close(fds[1]);
+		execv(path, args);
+		fputs("Unable to run ", stderr);
+		fputs(path, stderr);
+		fputc('\n', stderr);
+		_exit(EXIT_FAILURE);
+	}
+
+	close(fds[1]);
+	free(args);
+	free(path);
+	return fdopen(fds[0], "r");
+}
+#endif
+
 int main(int argc, char **argv)
 {
 	struct files_queue* list = NULL;
 	struct files_queue* a;
+	char* tool;
+#if !defined(__M2__)
+	char* drain;
+	int status;
+#endif
 	STRICT = TRUE;
 	FUZZING = FALSE;
+	JOBS = 1;
 	int r;
 
 	int i = 1;
@@ -403,6 +865,20 @@ int main(int argc, char **argv)
 				fputc('\n', stderr);
 				if(STRICT) exit(EXIT_FAILURE);
 			}
+			else if(NULL != (tool = decompressor_for(a->f)))
+			{
+#if defined(__M2__)
+				fputs(a->name, stderr);
+				fputs(" is compressed, run ", stderr);
+				fputs(tool, stderr);
+				fputs(" on it first\n", stderr);
+				exit(EXIT_FAILURE);
+#else
+				fclose(a->f);
+				a->f = open_decompressor(argv[0], tool, a->name, &a->pid);
+				require(NULL != a->f, "Unable to read from the decompressor\n");
+#endif
+			}
 			list = a;
 			i = i + 2;
 		}
@@ -412,6 +888,13 @@ int main(int argc, char **argv)
 			fputs("fuzz-mode enabled, preparing for chaos\n", stderr);
 			i = i + 1;
 		}
+		else if(match(argv[i], "-j") || match(argv[i], "--jobs"))
+		{
+			require(NULL != argv[i+1], "the --jobs option requires a number to be given\n");
+			JOBS = strtoint(argv[i+1]);
+			require(JOBS > 0, "the --jobs option requires a positive number\n");
+			i = i + 2;
+		}
 		else if(match(argv[i], "-v") || match(argv[i], "--verbose"))
 		{
 			VERBOSE = TRUE;
@@ -428,8 +911,10 @@ int main(int argc, char **argv)
 		{
 			fputs("Usage: ", stderr);
 			fputs(argv[0], stderr);
-			fputs(" --file $input.gz\n", stderr);
+			fputs(" --file $input.tar (or .tar.gz, .tar.bz2 or .tar.xz)\n", stderr);
+			fputs("compressed archives are read through the ungz, unbz2 or unxz installed next to untar\n", stderr);
 			fputs("--verbose to print list of extracted files\n", stderr);
+			fputs("--jobs $n to create and write files on n threads\n", stderr);
 			fputs("--help to get this message\n", stderr);
 			fputs("--fuzz-mode if you wish to fuzz this application safely\n", stderr);
 			fputs("--non-strict if you wish to just ignore files not existing\n", stderr);
@@ -448,11 +933,26 @@ int main(int argc, char **argv)
 	while(NULL != list)
 	{
 		r = untar(list->f, list->name);
+#if !defined(__M2__)
+		if(0 != list->pid)
+		{
+			/* Take the padding after the end of the archive too, so the
+			 * decompressor finishes instead of dying of SIGPIPE.
+			 */
+			drain = calloc(4096, sizeof(char));
+			while(0 < fread(drain, sizeof(char), 4096, list->f));
+			free(drain);
+			fclose(list->f);
+			list->f = NULL;
+			waitpid(list->pid, &status, 0);
+			if(!WIFEXITED(status) || (0 != WEXITSTATUS(status))) r = FALSE;
+		}
+#endif
 		fputs("The extraction of ", stderr);
 		fputs(list->name, stderr);
 		if(r) fputs(" was successful\n", stderr);
 		else fputs(" produced errors\n", stderr);
-		fclose(list->f);
+		if(NULL != list->f) fclose(list->f);
 		list = list->next;
 	}
 
@@ -35,8 +35,15 @@
 #include <unistd.h>  /* read(), write() */
 #include <stdint.h>
 #include <stdlib.h>  /* realloc() */
+#include <fcntl.h>  /* open() */
 #include "M2libc/bootstrappable.h"
 
+#if !defined(__M2__)
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
 /* Constants needed */
 #define SZ_OK 0
 #define SZ_ERROR_DATA 1
@@ -60,6 +67,7 @@
 #define LZMA2_LCLP_MAX 4
 #define MAX_DIC_SIZE 1610612736  /* ~1.61 GB. 2 GiB is user virtual memory limit for many 32-bit systems. */
 #define MAX_DIC_SIZE_PROP 37
+#define PARALLEL_OUT_MAX 268435456  /* Decompressed bytes held by the blocks decoding ahead, ten of xz -T6's 24 MiB. */
 #define MAX_MATCH_SIZE 273
 #define kNumTopBits 24
 #define kTopValue (1 << kNumTopBits)
@@ -122,11 +130,13 @@
 #define SZ_ERROR_BAD_DICPOS 65
 #define SZ_ERROR_MISSING_INITPROP 67
 #define SZ_ERROR_BAD_LCLPPB_PROP 68
+#define FILTER_ID_DELTA 0x03
+#define FILTER_ID_X86 0x04
+#define FILTER_ID_ARM64 0x0A
 #define FILTER_ID_LZMA2 0x21
+#define FILTER_BUF_SIZE 65536
 // 65536 + 12 * 1 byte (sizeof(uint8_t)
 #define sizeof_readBuf 65548
-#define sizeof_writeBuf 0x1000000
-#define MAX_DICF_SIZE (MAX_DIC_SIZE + MAX_MATCH_SIZE + sizeof_writeBuf)  /* Maximum number of bytes in global.dicf. */
 #define DUMMY_ERROR 0 /* unexpected end of input stream */
 #define DUMMY_LIT 1
 #define DUMMY_MATCH 2
@@ -137,17 +147,41 @@
 #define BITS32 (0x7FFFFFFF | BIT31)
 #define HIGHBITS (0xFFFFFFFF - BITS32)
 
-FILE* destination;
-FILE* source;
-uint32_t pos;
-
 /* For LZMA streams, lc <= 8, lp <= 4, lc + lp <= 8 + 4 == 12.
  * For LZMA2 streams, lc + lp <= 4.
  * Minimum value: 1846.
  * Maximum value for LZMA streams: 1846 + (768 << (8 + 4)) == 3147574.
  * Maximum value for LZMA2 streams: 1846 + (768 << 4) == 14134.
- * Memory usage of prob: sizeof(uint32_t) * value == (2 or 4) * value bytes.
+ * Memory usage of prob: PROB_BYTES * value bytes.
+ */
+
+/* Type and size of an entry of probs. Natively it is 16-bit like in the LZMA
+ * SDK, which halves the cache footprint of the model. M2-Planet gets 32-bit
+ * entries, whose upper bits the decoder masks with HIGHBITS; natively
+ * HIGHBITS is 0 and BITS32 all ones, so the compiler drops those masks.
  */
+#if defined(__M2__)
+#define CLzmaProb uint32_t
+#define PROB_BYTES 4
+#else
+#define CLzmaProb uint16_t
+#define PROB_BYTES 2
+#endif
+
+/* A BCJ or delta filter of an .xz block, between the LZMA2 output and Output. */
+struct XzFilter
+{
+	uint32_t id;
+	uint32_t pos;  /* Uncompressed position of buf[0], counted from the start offset. */
+	uint32_t prevMask;  /* x86 BCJ state. */
+	uint32_t prevPos;
+	uint32_t distance;  /* Delta distance. */
+	uint8_t* history;  /* The last 256 bytes for delta. */
+	uint32_t historyPos;
+	uint8_t* buf;  /* FILTER_BUF_SIZE bytes, the first bufLen are pending. */
+	uint32_t bufLen;
+	struct XzFilter* next;  /* Filter the output goes to, or NULL for Output. */
+};
 
 struct CLzmaDec
 {
@@ -166,30 +200,30 @@ struct CLzmaDec
 	uint32_t lp;
 	uint32_t pb; /* Configured in prop byte. */
 	/* Maximum lookback delta.
-	 * More optimized implementations (but not this version of muxzcat) need
-	 * that many bytes of storage for the dictionary. muxzcat uses more,
-	 * because it keeps the entire decompression output in memory, for
-	 * the simplicity of the implementation.
+	 * The dictionary is a circular buffer of exactly dicSize bytes (see
+	 * dicBufSize), so that is all the memory the output needs.
 	 * Configured in dicSizeProp byte. Maximum LZMA and LZMA2 supports is 0xffffffff,
 	 * maximum we support is MAX_DIC_SIZE == 1610612736.
 	 */
 	uint32_t dicSize;
+	uint32_t dicBufSize;  /* Size of the circular dictionary dicf; when dicfPos reaches it, output is flushed and decoding continues at dicf[0]. */
 	uint8_t *buf;
 	uint32_t range;
 	uint32_t code;
 	uint32_t dicfPos;  /* The next decompression output byte will be written to dicf + dicfPos. */
-	uint32_t dicfLimit;  /* It's OK to write this many decompression output bytes to dic. GrowDic(dicfPos + len) must be called before writing len bytes at dicfPos. */
+	uint32_t dicfLimit;  /* Decoding stops when dicfPos reaches this, dicfLimit <= dicBufSize. GrowDic(dec, dicfLimit) must be called before decoding. */
 	uint32_t writtenPos;  /* Decompression output bytes dicf[:writtenPos] are already written to the output file. writtenPos <= dicfPos. */
-	uint32_t discardedSize;  /* Number of decompression output bytes discarded. */
+	uint32_t discardedSize;  /* Number of decompression output bytes wrapped around out of dicf. */
 	uint32_t writeRemaining;  /* Maximum number of remaining bytes to write, or ~0 for unlimited. */
 	uint32_t allocCapacity;  /* Number of bytes allocated in dic. */
-	uint32_t processedPos;  /* Decompression output byte count since the last call to LzmaDec_InitDicAndState(TRUE, ...); */
+	uint32_t growCount;  /* Number of times dicf was grown, reported by --stats. */
+	uint32_t processedPos;  /* Decompression output byte count since the last call to LzmaDec_InitDicAndState(dec, TRUE, ...); */
 	uint32_t checkDicSize;
 	uint32_t state;
 	uint32_t reps[4];
 	uint32_t remainLen;
 	uint32_t tempBufSize;
-	uint32_t probs[probs_size];
+	CLzmaProb probs[probs_size];
 	int needFlush;
 	int needInitLzma;
 	int needInitDic;
@@ -197,136 +231,759 @@ struct CLzmaDec
 	int needInitProp;
 	uint8_t tempBuf[LZMA_REQUIRED_INPUT_MAX];
 	/* Contains the decompresison output, and used as the lookback dictionary.
-	 * allocCapacity bytes are allocated, it's OK to grow it up to dicfLimit.
+	 * allocCapacity bytes are allocated, it's OK to grow it up to dicBufSize.
 	 */
 	uint8_t *dicf;
 	uint8_t* readBuf;
 	uint8_t* readCur;
 	uint8_t* readEnd;
+	uint8_t* memOut;  /* Decompression output if destination < 0. */
+	uint32_t memOutLen;
+	uint32_t memOutSize;
+	uint32_t checkType;  /* Check type from the .xz stream flags, 0 (none) for .lzma. */
+	uint32_t crc32;
+	uint32_t crc64Lo;
+	uint32_t crc64Hi;
+	uint32_t* sha256;  /* SHA-256 state words, then the 64 message schedule words. */
+	uint8_t* shaBuf;  /* Partial 64-byte SHA-256 block. */
+	uint32_t shaBufLen;
+	uint32_t shaLen;  /* Bytes hashed, modulo 4 GiB. */
+	uint32_t shaLenHi;  /* Multiples of 4 GiB hashed. */
+	struct XzFilter* filters;  /* Filter chain of the current block, NULL if just LZMA2. */
+	/* Input comes from the source fd, or if it is negative, the caller has
+	 * pointed readBuf, readCur and readEnd at all of it. Output goes to the
+	 * destination fd, or if it is negative, collects in memOut.
+	 */
+	int source;
+	int destination;
 };
 
 /* globals needed */
-struct CLzmaDec* global;
 int FUZZING;
+int STATS;
+
+uint32_t GetLE4(uint8_t *p)
+{
+	return (0xFF & p[0]) | (0xFF & p[1]) << 8 | (0xFF & p[2]) << 16 | (0xFF & p[3]) << 24;
+}
+
+/* Check fields of .xz blocks (CRC32, CRC64 and SHA-256), computed over the
+ * output as Flush writes it. The CRC tables are shared by all threads and
+ * built once by InitCheckTables. Natively the CRCs use slicing-by-8, M2-Planet
+ * builds use the first of the 8 tables one byte at a time. CRC64 is kept as
+ * two 32-bit halves, as M2-Planet may not have 64-bit integers.
+ */
+uint32_t* crc32Table;
+uint32_t* crc64TableLo;
+uint32_t* crc64TableHi;
+#if !defined(__M2__)
+uint64_t* crc64Table;  /* crc64TableHi and crc64TableLo combined. */
+#endif
+uint32_t* sha256K;
+
+void InitCheckTables()
+{
+	uint32_t i;
+	uint32_t j;
+	uint32_t c;
+	uint32_t lo;
+	uint32_t hi;
+	uint32_t bit;
+
+	crc32Table = calloc(8 * 256 + 1, sizeof(uint32_t));
+	crc64TableLo = calloc(8 * 256 + 1, sizeof(uint32_t));
+	crc64TableHi = calloc(8 * 256 + 1, sizeof(uint32_t));
+	sha256K = calloc(64 + 1, sizeof(uint32_t));
+	require((NULL != crc32Table) && (NULL != crc64TableLo) && (NULL != crc64TableHi) && (NULL != sha256K), "Unable to allocate the check tables\n");
+
+	for(i = 0; i < 256; i = i + 1)
+	{
+		c = i;
+		lo = i;
+		hi = 0;
+
+		for(j = 0; j < 8; j = j + 1)
+		{
+			c = BITS32 & ((c >> 1) ^ (0xEDB88320 & (0 - (c & 1))));
+			bit = lo & 1;
+			lo = BITS32 & (((lo >> 1) | ((hi & 1) << 31)) ^ (0xD7870F42 & (0 - bit)));
+			hi = BITS32 & ((hi >> 1) ^ (0xC96C5795 & (0 - bit)));
+		}
+
+		crc32Table[i] = c;
+		crc64TableLo[i] = lo;
+		crc64TableHi[i] = hi;
+	}
+
+	/* Table k gives the CRC of a byte followed by k zero bytes. */
+	for(i = 256; i < 8 * 256; i = i + 1)
+	{
+		c = BITS32 & crc32Table[i - 256];
+		crc32Table[i] = BITS32 & ((c >> 8) ^ crc32Table[c & 0xFF]);
+		lo = BITS32 & crc64TableLo[i - 256];
+		hi = BITS32 & crc64TableHi[i - 256];
+		crc64TableLo[i] = BITS32 & (((lo >> 8) | ((hi & 0xFF) << 24)) ^ crc64TableLo[lo & 0xFF]);
+		crc64TableHi[i] = BITS32 & ((hi >> 8) ^ crc64TableHi[lo & 0xFF]);
+	}
+
+#if !defined(__M2__)
+	crc64Table = calloc(8 * 256, sizeof(uint64_t));
+	require(NULL != crc64Table, "Unable to allocate the check tables\n");
+
+	for(i = 0; i < 8 * 256; i = i + 1)
+	{
+		crc64Table[i] = ((uint64_t)crc64TableHi[i] << 32) | crc64TableLo[i];
+	}
+#endif
+
+	/* First 32 bits of the fractional parts of the cube roots of the first 64 primes. */
+	sha256K[0] = 0x428a2f98; sha256K[1] = 0x71374491; sha256K[2] = 0xb5c0fbcf; sha256K[3] = 0xe9b5dba5;
+	sha256K[4] = 0x3956c25b; sha256K[5] = 0x59f111f1; sha256K[6] = 0x923f82a4; sha256K[7] = 0xab1c5ed5;
+	sha256K[8] = 0xd807aa98; sha256K[9] = 0x12835b01; sha256K[10] = 0x243185be; sha256K[11] = 0x550c7dc3;
+	sha256K[12] = 0x72be5d74; sha256K[13] = 0x80deb1fe; sha256K[14] = 0x9bdc06a7; sha256K[15] = 0xc19bf174;
+	sha256K[16] = 0xe49b69c1; sha256K[17] = 0xefbe4786; sha256K[18] = 0x0fc19dc6; sha256K[19] = 0x240ca1cc;
+	sha256K[20] = 0x2de92c6f; sha256K[21] = 0x4a7484aa; sha256K[22] = 0x5cb0a9dc; sha256K[23] = 0x76f988da;
+	sha256K[24] = 0x983e5152; sha256K[25] = 0xa831c66d; sha256K[26] = 0xb00327c8; sha256K[27] = 0xbf597fc7;
+	sha256K[28] = 0xc6e00bf3; sha256K[29] = 0xd5a79147; sha256K[30] = 0x06ca6351; sha256K[31] = 0x14292967;
+	sha256K[32] = 0x27b70a85; sha256K[33] = 0x2e1b2138; sha256K[34] = 0x4d2c6dfc; sha256K[35] = 0x53380d13;
+	sha256K[36] = 0x650a7354; sha256K[37] = 0x766a0abb; sha256K[38] = 0x81c2c92e; sha256K[39] = 0x92722c85;
+	sha256K[40] = 0xa2bfe8a1; sha256K[41] = 0xa81a664b; sha256K[42] = 0xc24b8b70; sha256K[43] = 0xc76c51a3;
+	sha256K[44] = 0xd192e819; sha256K[45] = 0xd6990624; sha256K[46] = 0xf40e3585; sha256K[47] = 0x106aa070;
+	sha256K[48] = 0x19a4c116; sha256K[49] = 0x1e376c08; sha256K[50] = 0x2748774c; sha256K[51] = 0x34b0bcb5;
+	sha256K[52] = 0x391c0cb3; sha256K[53] = 0x4ed8aa4a; sha256K[54] = 0x5b9cca4f; sha256K[55] = 0x682e6ff3;
+	sha256K[56] = 0x748f82ee; sha256K[57] = 0x78a5636f; sha256K[58] = 0x84c87814; sha256K[59] = 0x8cc70208;
+	sha256K[60] = 0x90befffa; sha256K[61] = 0xa4506ceb; sha256K[62] = 0xbef9a3f7; sha256K[63] = 0xc67178f2;
+}
 
-/* Writes uncompressed data (global.dicf[global.writtenPos : global.dicfPos] to stdout. */
-void Flush()
+/* Returns the CRC32 of p[:n] continuing from crc (0 to start). */
+uint32_t Crc32(uint32_t crc, uint8_t* p, uint32_t n)
 {
-	/* print the bytes in the buffer until done */
-	uint8_t* p = global->dicf + global->writtenPos;
-	uint8_t* q = global->dicf + global->dicfPos;
+	crc = BITS32 & ~crc;
+
+#if !defined(__M2__)
+	uint32_t* t = crc32Table;
+
+	while(n >= 8)
+	{
+		crc = crc ^ (p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24));
+		crc = t[7 * 256 + (crc & 0xFF)] ^ t[6 * 256 + ((crc >> 8) & 0xFF)]
+		      ^ t[5 * 256 + ((crc >> 16) & 0xFF)] ^ t[4 * 256 + (crc >> 24)]
+		      ^ t[3 * 256 + p[4]] ^ t[2 * 256 + p[5]] ^ t[256 + p[6]] ^ t[p[7]];
+		p = p + 8;
+		n = n - 8;
+	}
+#endif
 
-	while(p < q)
+	while(n > 0)
 	{
-		fputc(0xFF & p[0], destination);
+		crc = BITS32 & ((crc >> 8) ^ crc32Table[(crc ^ p[0]) & 0xFF]);
 		p = p + 1;
+		n = n - 1;
 	}
 
-	global->writtenPos = global->dicfPos;
+	return BITS32 & ~crc;
 }
 
-void FlushDiscardOldFromStartOfDic()
+/* Continues the CRC64 in dec.crc64Lo and dec.crc64Hi over p[:n]. */
+void Crc64(struct CLzmaDec* dec, uint8_t* p, uint32_t n)
 {
-	if(global->dicfPos > global->dicSize)
+	uint32_t lo = BITS32 & ~dec->crc64Lo;
+	uint32_t hi = BITS32 & ~dec->crc64Hi;
+	uint32_t i;
+
+#if !defined(__M2__)
+	uint64_t* t = crc64Table;
+	uint64_t crc = ((uint64_t)hi << 32) | lo;
+
+	while(n >= 8)
 	{
-		uint32_t delta = global->dicfPos - global->dicSize;
+		lo = lo ^ (p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24));
+		crc = t[7 * 256 + (lo & 0xFF)] ^ t[6 * 256 + ((lo >> 8) & 0xFF)]
+		      ^ t[5 * 256 + ((lo >> 16) & 0xFF)] ^ t[4 * 256 + (lo >> 24)]
+		      ^ t[3 * 256 + ((hi ^ p[4]) & 0xFF)] ^ t[2 * 256 + (((hi >> 8) ^ p[5]) & 0xFF)]
+		      ^ t[256 + (((hi >> 16) ^ p[6]) & 0xFF)] ^ t[((hi >> 24) ^ p[7]) & 0xFF];
+		lo = crc;
+		hi = crc >> 32;
+		p = p + 8;
+		n = n - 8;
+	}
+#endif
+
+	while(n > 0)
+	{
+		i = (lo ^ p[0]) & 0xFF;
+		lo = BITS32 & (((lo >> 8) | ((hi & 0xFF) << 24)) ^ crc64TableLo[i]);
+		hi = BITS32 & ((hi >> 8) ^ crc64TableHi[i]);
+		p = p + 1;
+		n = n - 1;
+	}
+
+	dec->crc64Lo = BITS32 & ~lo;
+	dec->crc64Hi = BITS32 & ~hi;
+}
+
+uint32_t Rotr(uint32_t x, uint32_t n)
+{
+	x = BITS32 & x;
+	return BITS32 & ((x >> n) | (x << (32 - n)));
+}
 
-		if(delta + MAX_MATCH_SIZE >= sizeof_writeBuf)
+/* Runs the SHA-256 compression function on the 64 bytes in dec.shaBuf. */
+void Sha256Block(struct CLzmaDec* dec)
+{
+	uint32_t* h = dec->sha256;
+	uint32_t* w = dec->sha256 + 8;
+	uint8_t* p = dec->shaBuf;
+	uint32_t i;
+	uint32_t s0;
+	uint32_t s1;
+	uint32_t t1;
+	uint32_t t2;
+	uint32_t a = BITS32 & h[0];
+	uint32_t b = BITS32 & h[1];
+	uint32_t c = BITS32 & h[2];
+	uint32_t d = BITS32 & h[3];
+	uint32_t e = BITS32 & h[4];
+	uint32_t f = BITS32 & h[5];
+	uint32_t g = BITS32 & h[6];
+	uint32_t hh = BITS32 & h[7];
+
+	for(i = 0; i < 64; i = i + 1)
+	{
+		if(i < 16)
+		{
+			w[i] = ((0xFF & p[0]) << 24) | ((0xFF & p[1]) << 16) | ((0xFF & p[2]) << 8) | (0xFF & p[3]);
+			p = p + 4;
+		}
+		else
 		{
-			Flush();
-			global->dicf = memmove(global->dicf, global->dicf + delta, global->dicSize);
-			global->dicfPos = global->dicfPos - delta;
-			global->dicfLimit = global->dicfLimit - delta;
-			global->writtenPos = global->writtenPos - delta;
-			global->discardedSize = global->discardedSize + delta;
+			s0 = BITS32 & w[i - 15];
+			s0 = Rotr(s0, 7) ^ Rotr(s0, 18) ^ (s0 >> 3);
+			s1 = BITS32 & w[i - 2];
+			s1 = Rotr(s1, 17) ^ Rotr(s1, 19) ^ (s1 >> 10);
+			w[i] = BITS32 & (w[i - 16] + s0 + w[i - 7] + s1);
 		}
+
+		s1 = Rotr(e, 6) ^ Rotr(e, 11) ^ Rotr(e, 25);
+		t1 = BITS32 & (hh + s1 + ((e & f) ^ ((~e) & g)) + sha256K[i] + w[i]);
+		s0 = Rotr(a, 2) ^ Rotr(a, 13) ^ Rotr(a, 22);
+		t2 = BITS32 & (s0 + ((a & b) ^ (a & c) ^ (b & c)));
+		hh = g;
+		g = f;
+		f = e;
+		e = BITS32 & (d + t1);
+		d = c;
+		c = b;
+		b = a;
+		a = BITS32 & (t1 + t2);
 	}
 
+	h[0] = BITS32 & (h[0] + a);
+	h[1] = BITS32 & (h[1] + b);
+	h[2] = BITS32 & (h[2] + c);
+	h[3] = BITS32 & (h[3] + d);
+	h[4] = BITS32 & (h[4] + e);
+	h[5] = BITS32 & (h[5] + f);
+	h[6] = BITS32 & (h[6] + g);
+	h[7] = BITS32 & (h[7] + hh);
 }
 
-void GrowCapacity(uint32_t newCapacity)
+void Sha256(struct CLzmaDec* dec, uint8_t* p, uint32_t n)
 {
-	if(newCapacity > global->allocCapacity)
+	uint32_t take;
+
+	dec->shaLen = dec->shaLen + n;
+	/* Count bytes past 4 GiB, the length in bits needs 35 more bits. */
+	if((BITS32 & dec->shaLen) < n) dec->shaLenHi = dec->shaLenHi + 1;
+	dec->shaLen = BITS32 & dec->shaLen;
+
+	while(n > 0)
 	{
-		/* make sure we don't alloc too much */
-		require(newCapacity <= MAX_DICF_SIZE, "GrowCapacity exceeds MAX_DICF_SIZE");
+		take = 64 - dec->shaBufLen;
+		if(take > n) take = n;
+		memcpy(dec->shaBuf + dec->shaBufLen, p, take);
+		dec->shaBufLen = dec->shaBufLen + take;
+		p = p + take;
+		n = n - take;
+
+		if(dec->shaBufLen == 64)
+		{
+			Sha256Block(dec);
+			dec->shaBufLen = 0;
+		}
+	}
+}
 
-		/* Get our new block */
-		uint8_t* dicf = calloc(newCapacity, sizeof(uint8_t));
-		require(NULL != dicf, "GrowCapacity memory allocation failed");
+/* Resets the check of dec.checkType for a new block. */
+void InitCheck(struct CLzmaDec* dec)
+{
+	dec->crc32 = 0;
+	dec->crc64Lo = 0;
+	dec->crc64Hi = 0;
 
-		/* copy our old block into it  and get rid of the old block */
-		if (NULL != global->dicf) {
-			memcpy(dicf, global->dicf, global->allocCapacity);
-			free(global->dicf);
+	if(dec->checkType == 10)
+	{
+		if(NULL == dec->sha256)
+		{
+			dec->sha256 = calloc(8 + 64 + 1, sizeof(uint32_t));
+			dec->shaBuf = calloc(64, sizeof(uint8_t));
+			require((NULL != dec->sha256) && (NULL != dec->shaBuf), "Unable to allocate the SHA-256 state\n");
 		}
 
-		/* now track that new state */
-		global->dicf = dicf;
-		global->allocCapacity = newCapacity;
+		/* First 32 bits of the fractional parts of the square roots of the first 8 primes. */
+		dec->sha256[0] = 0x6a09e667;
+		dec->sha256[1] = 0xbb67ae85;
+		dec->sha256[2] = 0x3c6ef372;
+		dec->sha256[3] = 0xa54ff53a;
+		dec->sha256[4] = 0x510e527f;
+		dec->sha256[5] = 0x9b05688c;
+		dec->sha256[6] = 0x1f83d9ab;
+		dec->sha256[7] = 0x5be0cd19;
+		dec->shaBufLen = 0;
+		dec->shaLen = 0;
+		dec->shaLenHi = 0;
 	}
+}
 
-	/* else no need to grow */
+/* Adds output bytes p[:n] to the check of the current block. */
+void UpdateCheck(struct CLzmaDec* dec, uint8_t* p, uint32_t n)
+{
+	if(dec->checkType == 1) dec->crc32 = Crc32(dec->crc32, p, n);
+	else if(dec->checkType == 4) Crc64(dec, p, n);
+	else if(dec->checkType == 10) Sha256(dec, p, n);
 }
 
-void FlushDiscardGrowDic(uint32_t dicfPosDelta)
+/* Compares the check of the current block with the stored check field at p. */
+uint32_t VerifyCheck(struct CLzmaDec* dec, uint8_t* p)
 {
-	uint32_t minCapacity = global->dicfPos + dicfPosDelta;
-	uint32_t newCapacity;
+	uint32_t i;
+	uint32_t bits;
+	uint8_t* pad;
+
+	if(dec->checkType == 1)
+	{
+		if(GetLE4(p) != dec->crc32) return SZ_ERROR_CRC;
+	}
+	else if(dec->checkType == 4)
+	{
+		if((GetLE4(p) != dec->crc64Lo) || (GetLE4(p + 4) != dec->crc64Hi)) return SZ_ERROR_CRC;
+	}
+	else if(dec->checkType == 10)
+	{
+		/* Pad with 0x80, zeros and the big-endian length in bits. */
+		pad = calloc(72, sizeof(uint8_t));
+		require(NULL != pad, "Unable to allocate the SHA-256 padding\n");
+		pad[0] = 0x80;
+		bits = BITS32 & (dec->shaLen << 3);
+		pad[71] = 0xFF & bits;
+		pad[70] = 0xFF & (bits >> 8);
+		pad[69] = 0xFF & (bits >> 16);
+		pad[68] = 0xFF & (bits >> 24);
+		bits = BITS32 & ((dec->shaLenHi << 3) | (dec->shaLen >> 29));
+		pad[67] = 0xFF & bits;
+		pad[66] = 0xFF & (bits >> 8);
+		pad[65] = 0xFF & (bits >> 16);
+		pad[64] = 0xFF & (bits >> 24);
+		i = (64 + 56 - dec->shaBufLen - 1) % 64 + 1;
+		Sha256(dec, pad, i);
+		Sha256(dec, pad + 64, 8);
+		free(pad);
+
+		for(i = 0; i < 8; i = i + 1)
+		{
+			if(((0xFF & p[0]) << 24 | (0xFF & p[1]) << 16 | (0xFF & p[2]) << 8 | (0xFF & p[3])) != (BITS32 & dec->sha256[i])) return SZ_ERROR_CRC;
+			p = p + 4;
+		}
+	}
+
+	return SZ_OK;
+}
+
+/* Writes n bytes at p to fd, retrying short writes. */
+void WriteAll(int fd, uint8_t* p, uint32_t n)
+{
+	int r;
+
+	while(n > 0)
+	{
+		r = write(fd, p, n);
+		require(r > 0, "Unable to write the output\n");
+		p = p + r;
+		n = n - r;
+	}
+}
+
+/* Passes n bytes of final output at p on to the check and destination. */
+void Output(struct CLzmaDec* dec, uint8_t* p, uint32_t n)
+{
+	UpdateCheck(dec, p, n);
+
+	if(dec->destination < 0)
+	{
+		if(dec->memOutLen + n > dec->memOutSize)
+		{
+			dec->memOutSize = (2 * dec->memOutSize) + n;
+			dec->memOut = realloc(dec->memOut, dec->memOutSize);
+			require(NULL != dec->memOut, "Unable to grow the output buffer\n");
+		}
+
+		memcpy(dec->memOut + dec->memOutLen, p, n);
+		dec->memOutLen = dec->memOutLen + n;
+	}
+	else WriteAll(dec->destination, p, n);
+}
+
+/* x86 BCJ decoder, based on simple/x86.c of XZ Utils. Converts the absolute
+ * addresses of E8/E9 (call/jmp) instructions in buf[:size] back to relative
+ * ones, and returns how many bytes are final: the last 4 bytes need to see
+ * what follows them first.
+ */
+uint32_t BcjX86(struct XzFilter* f, uint8_t* buf, uint32_t size)
+{
+	uint32_t prevMask = f->prevMask;
+	uint32_t prevPos = f->prevPos;
+	uint32_t nowPos = f->pos;
+	uint32_t bufPos = 0;
+	uint32_t offset;
+	uint32_t b;
+	uint32_t i;
+	uint32_t src;
+	uint32_t dest;
 
-	if(minCapacity > global->allocCapacity)
+	if(size < 5) return 0;
+	if((BITS32 & (nowPos - prevPos)) > 5) prevPos = BITS32 & (nowPos - 5);
+
+	while(bufPos <= size - 5)
 	{
-		FlushDiscardOldFromStartOfDic();
-		minCapacity = global->dicfPos + dicfPosDelta;
+		b = 0xFF & buf[bufPos];
+
+		if((b != 0xE8) && (b != 0xE9))
+		{
+			bufPos = bufPos + 1;
+			continue;
+		}
+
+		offset = BITS32 & (nowPos + bufPos - prevPos);
+		prevPos = BITS32 & (nowPos + bufPos);
 
-		if(minCapacity > global->allocCapacity)
+		if(offset > 5) prevMask = 0;
+		else
+		{
+			for(i = 0; i < offset; i = i + 1)
+			{
+				prevMask = (prevMask & 0x77) << 1;
+			}
+		}
+
+		b = 0xFF & buf[bufPos + 4];
+		i = (prevMask >> 1) & 7;
+
+		/* The most significant byte is 0 or 0xFF, and the mask status allows it. */
+		if(((b == 0) || (b == 0xFF)) && ((i <= 2) || (i == 4)) && ((prevMask >> 1) < 0x10))
 		{
-			/* start by assuming 64KB */
-			newCapacity = (1 << 16);
+			src = BITS32 & ((b << 24) | ((0xFF & buf[bufPos + 3]) << 16) | ((0xFF & buf[bufPos + 2]) << 8) | (0xFF & buf[bufPos + 1]));
 
-			while(newCapacity + MAX_MATCH_SIZE < minCapacity)
+			while(TRUE)
 			{
-				/* No overflow. */
-				if(newCapacity > global->dicSize)
-				{
-					newCapacity = global->dicSize;
-					if(newCapacity + MAX_MATCH_SIZE < minCapacity)
-					{
-						newCapacity = minCapacity - MAX_MATCH_SIZE;
-					}
-					break;
-				}
-				newCapacity = newCapacity << 1;
+				dest = BITS32 & (src - (nowPos + bufPos + 5));
+				if(prevMask == 0) break;
+
+				/* Bit number of the mask: 0, 1, 2, 2, 3, 3, 3, 3. */
+				i = prevMask >> 1;
+				if(i > 3) i = 3;
+				else if(i == 3) i = 2;
+
+				b = 0xFF & (dest >> (24 - i * 8));
+				if((b != 0) && (b != 0xFF)) break;
+				src = BITS32 & (dest ^ ((1 << (32 - i * 8)) - 1));
 			}
 
-			GrowCapacity(newCapacity + MAX_MATCH_SIZE);
+			if(0 != ((dest >> 24) & 1)) b = 0xFF;
+			else b = 0;
+
+			buf[bufPos + 4] = b | ((~0xFF) & buf[bufPos + 4]);
+			buf[bufPos + 3] = (0xFF & (dest >> 16)) | ((~0xFF) & buf[bufPos + 3]);
+			buf[bufPos + 2] = (0xFF & (dest >> 8)) | ((~0xFF) & buf[bufPos + 2]);
+			buf[bufPos + 1] = (0xFF & dest) | ((~0xFF) & buf[bufPos + 1]);
+			bufPos = bufPos + 5;
+			prevMask = 0;
+		}
+		else
+		{
+			bufPos = bufPos + 1;
+			prevMask = prevMask | 1;
+			if((b == 0) || (b == 0xFF)) prevMask = prevMask | 0x10;
+		}
+	}
+
+	f->prevMask = prevMask;
+	f->prevPos = prevPos;
+	return bufPos;
+}
+
+/* ARM64 BCJ decoder, based on simple/arm64.c of XZ Utils. Converts the
+ * addresses of BL and ADRP instructions in buf[:size] back, and returns how
+ * many bytes are final: the whole 4-byte instructions.
+ */
+uint32_t BcjArm64(struct XzFilter* f, uint8_t* buf, uint32_t size)
+{
+	uint32_t i;
+	uint32_t pc;
+	uint32_t instr;
+	uint32_t src;
+	uint32_t dest;
+
+	for(i = 0; i + 4 <= size; i = i + 4)
+	{
+		pc = BITS32 & (f->pos + i);
+		instr = GetLE4(buf + i);
+
+		if((instr >> 26) == 0x25)
+		{
+			/* BL instruction */
+			pc = BITS32 & (0 - (pc >> 2));
+			instr = 0x94000000 | ((instr + pc) & 0x03FFFFFF);
+		}
+		else if((instr & 0x9F000000) == 0x90000000)
+		{
+			/* ADRP instruction */
+			src = ((instr >> 29) & 3) | ((instr >> 3) & 0x001FFFFC);
+			if(0 != ((src + 0x00020000) & 0x001C0000)) continue;
+
+			pc = BITS32 & (0 - (pc >> 12));
+			dest = BITS32 & (src + pc);
+			instr = (instr & 0x9000001F) | ((dest & 3) << 29) | ((dest & 0x0003FFFC) << 3) | (BITS32 & (0 - (dest & 0x00020000)) & 0x00E00000);
+		}
+		else continue;
+
+		buf[i] = (0xFF & instr) | ((~0xFF) & buf[i]);
+		buf[i + 1] = (0xFF & (instr >> 8)) | ((~0xFF) & buf[i + 1]);
+		buf[i + 2] = (0xFF & (instr >> 16)) | ((~0xFF) & buf[i + 2]);
+		buf[i + 3] = (0xFF & (instr >> 24)) | ((~0xFF) & buf[i + 3]);
+	}
+
+	return i;
+}
+
+/* Delta decoder: adds the byte distance bytes back to every byte. */
+uint32_t Delta(struct XzFilter* f, uint8_t* buf, uint32_t size)
+{
+	uint8_t* history = f->history;
+	uint32_t i;
+	uint32_t b;
+
+	for(i = 0; i < size; i = i + 1)
+	{
+		b = 0xFF & (buf[i] + history[0xFF & (f->distance + f->historyPos)]);
+		buf[i] = b | ((~0xFF) & buf[i]);
+		history[f->historyPos] = b | ((~0xFF) & history[f->historyPos]);
+		f->historyPos = 0xFF & (f->historyPos - 1);
+	}
+
+	return size;
+}
+
+/* Runs n bytes at p through filter f and the ones after it, then to Output.
+ * The bytes a filter can't decode yet wait in f->buf, and final passes them
+ * on as they are at the end of the block.
+ */
+void FilterWrite(struct CLzmaDec* dec, struct XzFilter* f, uint8_t* p, uint32_t n, int final)
+{
+	uint32_t take;
+	uint32_t done;
+
+	if(NULL == f)
+	{
+		Output(dec, p, n);
+		return;
+	}
+
+	do
+	{
+		take = FILTER_BUF_SIZE - f->bufLen;
+		if(take > n) take = n;
+		memcpy(f->buf + f->bufLen, p, take);
+		f->bufLen = f->bufLen + take;
+		p = p + take;
+		n = n - take;
+
+		if(f->id == FILTER_ID_X86) done = BcjX86(f, f->buf, f->bufLen);
+		else if(f->id == FILTER_ID_ARM64) done = BcjArm64(f, f->buf, f->bufLen);
+		else done = Delta(f, f->buf, f->bufLen);
+
+		if(final && (n == 0)) done = f->bufLen;
+
+		FilterWrite(dec, f->next, f->buf, done, FALSE);
+		f->pos = BITS32 & (f->pos + done);
+		f->bufLen = f->bufLen - done;
+		memmove(f->buf, f->buf + done, f->bufLen);
+	} while(n > 0);
+
+	if(final) FilterWrite(dec, f->next, NULL, 0, TRUE);
+}
+
+/* Frees the filter chain of the last block. */
+void FreeFilters(struct CLzmaDec* dec)
+{
+	struct XzFilter* f;
+
+	while(NULL != dec->filters)
+	{
+		f = dec->filters;
+		dec->filters = f->next;
+		free(f->buf);
+		free(f->history);
+		free(f);
+	}
+}
+
+/* Allocates the state of one decoder, no two decoders share anything but the
+ * check tables, so each can run on its own thread.
+ */
+struct CLzmaDec* NewDecoder(int source, int destination)
+{
+	struct CLzmaDec* dec = calloc(1, sizeof(struct CLzmaDec));
+	require(NULL != dec, "Unable to allocate the decoder state\n");
+	dec->source = source;
+	dec->destination = destination;
+
+	if(source >= 0)
+	{
+		dec->readBuf = calloc(sizeof_readBuf, sizeof(uint8_t));
+		require(NULL != dec->readBuf, "Unable to allocate the input buffer\n");
+		dec->readCur = dec->readBuf;
+		dec->readEnd = dec->readBuf;
+	}
+
+	return dec;
+}
+
+void FreeDecoder(struct CLzmaDec* dec)
+{
+	FreeFilters(dec);
+	if(dec->source >= 0) free(dec->readBuf);
+	free(dec->dicf);
+	free(dec->memOut);
+	free(dec->sha256);
+	free(dec->shaBuf);
+	free(dec);
+}
+
+/* Writes uncompressed data (dec.dicf[dec.writtenPos : dec.dicfPos] to destination. */
+void Flush(struct CLzmaDec* dec)
+{
+	/* The range is contiguous, so this is one write(2) unless it's short. */
+	uint8_t* p = dec->dicf + dec->writtenPos;
+	uint32_t n = dec->dicfPos - dec->writtenPos;
+
+	/* The filters work on a copy, the dictionary has to stay as LZMA2 made it. */
+	if(NULL == dec->filters) Output(dec, p, n);
+	else FilterWrite(dec, dec->filters, p, n, FALSE);
+
+	dec->writtenPos = dec->dicfPos;
+}
+
+/* Flushes the output and, once the end of the circular dictionary is reached,
+ * continues at its start. The bytes there stay around as lookback until they
+ * are overwritten.
+ */
+void FlushWrap(struct CLzmaDec* dec)
+{
+	Flush(dec);
+
+	if(dec->dicfPos == dec->dicBufSize)
+	{
+		dec->dicfPos = 0;
+		dec->writtenPos = 0;
+		dec->discardedSize = dec->discardedSize + dec->dicBufSize;
+	}
+}
+
+/* Large capacities are rounded up to a multiple of this, so the allocator
+ * can back dicf with huge pages.
+ */
+#define DICF_ALIGN (1 << 21)
+
+void GrowCapacity(struct CLzmaDec* dec, uint32_t newCapacity)
+{
+	uint8_t* dicf;
+
+	if(newCapacity > dec->allocCapacity)
+	{
+		if(newCapacity >= DICF_ALIGN)
+		{
+			newCapacity = (newCapacity + (DICF_ALIGN - 1)) & ~(DICF_ALIGN - 1);
+		}
+
+		/* make sure we don't alloc too much */
+		require(newCapacity <= MAX_DIC_SIZE, "GrowCapacity exceeds MAX_DIC_SIZE");
+
+		/* realloc keeps the old bytes (for big blocks often by remapping
+		 * the pages instead of copying), and the new ones needn't be
+		 * zeroed: they are always written before they are read.
+		 */
+		dicf = realloc(dec->dicf, newCapacity);
+		require(NULL != dicf, "GrowCapacity memory allocation failed");
+
+		/* now track that new state */
+		dec->dicf = dicf;
+		dec->allocCapacity = newCapacity;
+		dec->growCount = dec->growCount + 1;
+	}
+
+	/* else no need to grow */
+}
+
+/* Makes sure dicf[:limit] is allocated. The dictionary starts at 64KB and
+ * doubles up to dicBufSize as needed, so short outputs don't pay for the
+ * full dictionary size and long ones only grow it O(log(dicSize)) times.
+ */
+void GrowDic(struct CLzmaDec* dec, uint32_t limit)
+{
+	uint32_t newCapacity;
+
+	if(limit > dec->allocCapacity)
+	{
+		newCapacity = dec->allocCapacity << 1;
+		if(newCapacity < (1 << 16)) newCapacity = (1 << 16);
+
+		while(newCapacity < limit)
+		{
+			newCapacity = newCapacity << 1;
+		}
+
+		if(newCapacity > dec->dicBufSize)
+		{
+			newCapacity = dec->dicBufSize;
 		}
+
+		GrowCapacity(dec, newCapacity);
 	}
 }
 
 
-void LzmaDec_DecodeReal(uint32_t limit, uint8_t *bufLimit)
+void LzmaDec_DecodeReal(struct CLzmaDec* dec, uint32_t limit, uint8_t *bufLimit)
 {
-	uint32_t *probs = global->probs;
-	uint32_t state = global->state;
-	uint32_t rep0 = global->reps[0];
-	uint32_t rep1 = global->reps[1];
-	uint32_t rep2 = global->reps[2];
-	uint32_t rep3 = global->reps[3];
-	uint32_t pbMask = (1 << (global->pb)) - 1;
-	uint32_t lpMask = (1 << (global->lp)) - 1;
-	uint32_t lc = global->lc;
-	uint8_t* dicl = global->dicf;
-	uint32_t diclLimit = global->dicfLimit;
-	uint32_t diclPos = global->dicfPos;
-	uint32_t processedPos = global->processedPos;
-	uint32_t checkDicSize = global->checkDicSize;
+	CLzmaProb* probs = dec->probs;
+	uint32_t state = dec->state;
+	uint32_t rep0 = dec->reps[0];
+	uint32_t rep1 = dec->reps[1];
+	uint32_t rep2 = dec->reps[2];
+	uint32_t rep3 = dec->reps[3];
+	uint32_t pbMask = (1 << (dec->pb)) - 1;
+	uint32_t lpMask = (1 << (dec->lp)) - 1;
+	uint32_t lc = dec->lc;
+	uint8_t* dicl = dec->dicf;
+	uint32_t dicBufSize = dec->dicBufSize;
+	uint32_t diclPos = dec->dicfPos;
+	uint32_t processedPos = dec->processedPos;
+	uint32_t checkDicSize = dec->checkDicSize;
 	uint32_t len = 0;
-	uint8_t* buf = global->buf;
-	uint32_t range = global->range;
-	uint32_t code = global->code;
+	uint8_t* buf = dec->buf;
+	uint32_t range = dec->range;
+	uint32_t code = dec->code;
 
-	uint32_t* prob;
+	CLzmaProb* prob;
 	uint32_t bound;
 	uint32_t ttt;
 	uint32_t posState;
@@ -334,10 +991,11 @@ void LzmaDec_DecodeReal(uint32_t limit, uint8_t *bufLimit)
 	uint32_t matchByte;
 	uint32_t offs;
 	uint32_t bit;
-	uint32_t* probLit;
+	uint32_t bitMask;
+	CLzmaProb* probLit;
 	uint32_t distance;
 	uint32_t limita;
-	uint32_t *probLen;
+	CLzmaProb* probLen;
 	uint32_t offset;
 	uint32_t posSlot;
 	uint32_t numDirectBits;
@@ -354,7 +1012,7 @@ void LzmaDec_DecodeReal(uint32_t limit, uint8_t *bufLimit)
 	{
 		posState = processedPos & pbMask;
 		p = probs;
-		prob = p + 4 * (IsMatch + (state << kNumPosBitsMax) + posState);
+		prob = p + PROB_BYTES * (IsMatch + (state << kNumPosBitsMax) + posState);
 		ttt = prob[0];
 
 		if(range < kTopValue)
@@ -371,19 +1029,19 @@ void LzmaDec_DecodeReal(uint32_t limit, uint8_t *bufLimit)
 			range = bound;
 			prob[0] = (BITS32 & ((ttt + ((kBitModelTotal - ttt) >> kNumMoveBits)))) | (HIGHBITS & prob[0]);
 			p = probs;
-			prob = p + 4 * Literal;
+			prob = p + PROB_BYTES * Literal;
 
 			if(checkDicSize != 0 || processedPos != 0)
 			{
 				if(diclPos == 0)
 				{
 					p = prob;
-					prob = p + 4 * (LZMA_LIT_SIZE * (((processedPos & lpMask) << lc) + (0xFF & dicl[(diclLimit) - 1])) >> (8 - lc));
+					prob = p + PROB_BYTES * (LZMA_LIT_SIZE * (((processedPos & lpMask) << lc) + ((0xFF & dicl[dicBufSize - 1]) >> (8 - lc))));
 				}
 				else
 				{
 					p = prob;
-					prob = p + 4 *(LZMA_LIT_SIZE * ((((processedPos & lpMask) << lc) + (0xFF & dicl[diclPos - 1])) >> (8 - lc)));
+					prob = p + PROB_BYTES * (LZMA_LIT_SIZE * (((processedPos & lpMask) << lc) + ((0xFF & dicl[diclPos - 1]) >> (8 - lc))));
 				}
 			}
 
@@ -406,6 +1064,7 @@ void LzmaDec_DecodeReal(uint32_t limit, uint8_t *bufLimit)
 
 					bound = (range >> kNumBitModelTotalBits) * ttt;
 
+#if defined(__M2__)
 					if(code < bound)
 					{
 						range = bound;
@@ -419,11 +1078,19 @@ void LzmaDec_DecodeReal(uint32_t limit, uint8_t *bufLimit)
 						prob[symbol] = (BITS32 & ((ttt - (ttt >> kNumMoveBits)))) | (HIGHBITS & prob[symbol]);
 						symbol = (symbol + symbol) + 1;
 					}
+#else
+					/* Branchless: bitMask is all ones if the bit is 1. */
+					bitMask = 0 - (uint32_t)(code >= bound);
+					range = (bound & ~bitMask) | ((range - bound) & bitMask);
+					code = code - (bound & bitMask);
+					prob[symbol] = ttt + (((kBitModelTotal - ttt) >> kNumMoveBits) & ~bitMask) - ((ttt >> kNumMoveBits) & bitMask);
+					symbol = (symbol + symbol) + (bitMask & 1);
+#endif
 				} while(symbol < 0x100);
 			}
 			else
 			{
-				if(diclPos < rep0) matchByte = 0xFF & dicl[(diclPos - rep0) + diclLimit];
+				if(diclPos < rep0) matchByte = 0xFF & dicl[(diclPos - rep0) + dicBufSize];
 				else matchByte = 0xFF & dicl[(diclPos - rep0)];
 
 				offs = 0x100;
@@ -438,7 +1105,7 @@ void LzmaDec_DecodeReal(uint32_t limit, uint8_t *bufLimit)
 					matchByte = matchByte << 1;
 					bit = (matchByte & offs);
 					p = prob;
-					probLit = p + 4 * (offs + bit + symbol);
+					probLit = p + PROB_BYTES * (offs + bit + symbol);
 					ttt = probLit[0];
 
 					if(range < kTopValue)
@@ -450,6 +1117,7 @@ void LzmaDec_DecodeReal(uint32_t limit, uint8_t *bufLimit)
 
 					bound = (range >> kNumBitModelTotalBits) * ttt;
 
+#if defined(__M2__)
 					if(code < bound)
 					{
 						range = bound;
@@ -465,18 +1133,18 @@ void LzmaDec_DecodeReal(uint32_t limit, uint8_t *bufLimit)
 						symbol = (symbol + symbol) + 1;
 						offs = offs & bit;
 					}
+#else
+					/* Branchless: bitMask is all ones if the bit is 1. */
+					bitMask = 0 - (uint32_t)(code >= bound);
+					range = (bound & ~bitMask) | ((range - bound) & bitMask);
+					code = code - (bound & bitMask);
+					probLit[0] = ttt + (((kBitModelTotal - ttt) >> kNumMoveBits) & ~bitMask) - ((ttt >> kNumMoveBits) & bitMask);
+					symbol = (symbol + symbol) + (bitMask & 1);
+					offs = offs & (bit ^ ~bitMask);
+#endif
 				} while(symbol < 0x100);
 			}
 
-			if(diclPos >= global->allocCapacity)
-			{
-				global->dicfPos = diclPos;
-				FlushDiscardGrowDic(1);
-				dicl = global->dicf;
-				diclLimit = global->dicfLimit;
-				diclPos = global->dicfPos;
-			}
-
 			dicl[diclPos] = (0xFF & symbol) | ((~0xFF) & dicl[diclPos]);
 			diclPos = diclPos + 1;
 			processedPos = processedPos + 1;
@@ -488,7 +1156,7 @@ void LzmaDec_DecodeReal(uint32_t limit, uint8_t *bufLimit)
 			code = code - bound;
 			prob[0] = (BITS32 & ((ttt - (ttt >> kNumMoveBits)))) | (HIGHBITS & prob[0]);
 			p = probs;
-			prob = p + 4 * (IsRep + state);
+			prob = p + PROB_BYTES * (IsRep + state);
 			ttt = prob[0];
 
 			if(range < kTopValue)
@@ -506,7 +1174,7 @@ void LzmaDec_DecodeReal(uint32_t limit, uint8_t *bufLimit)
 				prob[0] = (BITS32 & ((ttt + ((kBitModelTotal - ttt) >> kNumMoveBits)))) | (HIGHBITS & prob[0]);
 				state = state + kNumStates;
 				p = probs;
-				prob = p + 4 * LenCoder;
+				prob = p + PROB_BYTES * LenCoder;
 			}
 			else
 			{
@@ -517,7 +1185,7 @@ void LzmaDec_DecodeReal(uint32_t limit, uint8_t *bufLimit)
 				require((checkDicSize != 0) || (processedPos != 0), "checkDicsize == 0 && processPos == 0");
 
 				p = probs;
-				prob = p + 4 * (IsRepG0 + state);
+				prob = p + PROB_BYTES * (IsRepG0 + state);
 				ttt = prob[0];
 
 				if(range < kTopValue)
@@ -534,7 +1202,7 @@ void LzmaDec_DecodeReal(uint32_t limit, uint8_t *bufLimit)
 					range = bound;
 					prob[0] = (BITS32 & ((ttt + ((kBitModelTotal - ttt) >> kNumMoveBits)))) | (HIGHBITS & prob[0]);
 					p = probs;
-					prob = p + 4 * (IsRep0Long + (state << kNumPosBitsMax) + posState);
+					prob = p + PROB_BYTES * (IsRep0Long + (state << kNumPosBitsMax) + posState);
 					ttt = prob[0];
 
 					if(range < kTopValue)
@@ -551,16 +1219,7 @@ void LzmaDec_DecodeReal(uint32_t limit, uint8_t *bufLimit)
 						range = bound;
 						prob[0] = (BITS32 & ((ttt + ((kBitModelTotal - ttt) >> kNumMoveBits)))) | (HIGHBITS & prob[0]);
 
-						if(diclPos >= global->allocCapacity)
-						{
-							global->dicfPos = diclPos;
-							FlushDiscardGrowDic(1);
-							dicl = global->dicf;
-							diclLimit = global->dicfLimit;
-							diclPos = global->dicfPos;
-						}
-
-						if(diclPos < rep0) dicl[diclPos] = (0xFF & dicl[(diclPos - rep0) + diclLimit]) | ((~0xFF) & dicl[diclPos]);
+						if(diclPos < rep0) dicl[diclPos] = (0xFF & dicl[(diclPos - rep0) + dicBufSize]) | ((~0xFF) & dicl[diclPos]);
 						else dicl[diclPos] = (0xFF & dicl[(diclPos - rep0)]) | ((~0xFF) & dicl[diclPos]);
 
 						diclPos = diclPos + 1;
@@ -582,7 +1241,7 @@ void LzmaDec_DecodeReal(uint32_t limit, uint8_t *bufLimit)
 					code = code - bound;
 					prob[0] = (BITS32 & ((ttt - (ttt >> kNumMoveBits)))) | (HIGHBITS & prob[0]);
 					p = probs;
-					prob = p + 4 * (IsRepG1 + state);
+					prob = p + PROB_BYTES * (IsRepG1 + state);
 					ttt = prob[0];
 
 					if(range < kTopValue)
@@ -606,7 +1265,7 @@ void LzmaDec_DecodeReal(uint32_t limit, uint8_t *bufLimit)
 						code = code - bound;
 						prob[0] = (BITS32 & ((ttt - (ttt >> kNumMoveBits)))) | (HIGHBITS & prob[0]);
 						p = probs;
-						prob = p + 4 * (IsRepG2 + state);
+						prob = p + PROB_BYTES * (IsRepG2 + state);
 						ttt = prob[0];
 
 						if(range < kTopValue)
@@ -644,11 +1303,11 @@ void LzmaDec_DecodeReal(uint32_t limit, uint8_t *bufLimit)
 				else state = 11;
 
 				p = probs;
-				prob = p + 4 * RepLenCoder;
+				prob = p + PROB_BYTES * RepLenCoder;
 			}
 
 			p = prob;
-			probLen = p + 4 * LenChoice;
+			probLen = p + PROB_BYTES * LenChoice;
 			ttt = probLen[0];
 
 			if(range < kTopValue)
@@ -665,7 +1324,7 @@ void LzmaDec_DecodeReal(uint32_t limit, uint8_t *bufLimit)
 				range = bound;
 				probLen[0] = (BITS32 & ((ttt + ((kBitModelTotal - ttt) >> kNumMoveBits)))) | (HIGHBITS & probLen[0]);
 				p = prob;
-				probLen = p + 4 * (LenLow + (posState << kLenNumLowBits));
+				probLen = p + PROB_BYTES * (LenLow + (posState << kLenNumLowBits));
 				offset = 0;
 				limita = (1 << kLenNumLowBits);
 			}
@@ -675,7 +1334,7 @@ void LzmaDec_DecodeReal(uint32_t limit, uint8_t *bufLimit)
 				code = code - bound;
 				probLen[0] = (BITS32 & ((ttt - (ttt >> kNumMoveBits)))) | (HIGHBITS & probLen[0]);
 				p = prob;
-				probLen = p + 4 * LenChoice2;
+				probLen = p + PROB_BYTES * LenChoice2;
 				ttt = probLen[0];
 
 				if(range < kTopValue)
@@ -692,7 +1351,7 @@ void LzmaDec_DecodeReal(uint32_t limit, uint8_t *bufLimit)
 					range = bound;
 					probLen[0] = (BITS32 & ((ttt + ((kBitModelTotal - ttt) >> kNumMoveBits)))) | (HIGHBITS & probLen[0]);
 					p = prob;
-					probLen = p + 4 * (LenMid + (posState << kLenNumMidBits));
+					probLen = p + PROB_BYTES * (LenMid + (posState << kLenNumMidBits));
 					offset = kLenNumLowSymbols;
 					limita = (1 << kLenNumMidBits);
 				}
@@ -702,7 +1361,7 @@ void LzmaDec_DecodeReal(uint32_t limit, uint8_t *bufLimit)
 					code = code - bound;
 					probLen[0] = (BITS32 & ((ttt - (ttt >> kNumMoveBits)))) | (HIGHBITS & probLen[0]);
 					p = prob;
-					probLen = p + 4 * LenHigh;
+					probLen = p + PROB_BYTES * LenHigh;
 					offset = kLenNumLowSymbols + kLenNumMidSymbols;
 					limita = (1 << kLenNumHighBits);
 				}
@@ -723,6 +1382,7 @@ void LzmaDec_DecodeReal(uint32_t limit, uint8_t *bufLimit)
 
 				bound = (range >> kNumBitModelTotalBits) * ttt;
 
+#if defined(__M2__)
 				if(code < bound)
 				{
 					range = bound;
@@ -736,14 +1396,22 @@ void LzmaDec_DecodeReal(uint32_t limit, uint8_t *bufLimit)
 					probLen[len] = (BITS32 & ((ttt - (ttt >> kNumMoveBits)))) | (HIGHBITS & probLen[len]);
 					len = (len + len) + 1;
 				}
+#else
+				/* Branchless: bitMask is all ones if the bit is 1. */
+				bitMask = 0 - (uint32_t)(code >= bound);
+				range = (bound & ~bitMask) | ((range - bound) & bitMask);
+				code = code - (bound & bitMask);
+				probLen[len] = ttt + (((kBitModelTotal - ttt) >> kNumMoveBits) & ~bitMask) - ((ttt >> kNumMoveBits) & bitMask);
+				len = (len + len) + (bitMask & 1);
+#endif
 			} while(len < limita);
 
 			len = len - limita + offset;
 
 			if(state >= kNumStates)
 			{
-				if(len < kNumLenToPosStates) { p = probs; prob = p + 4 * (PosSlot + (len << kNumPosSlotBits));  }
-				else { p = probs; prob = p + 4 * (PosSlot + ((kNumLenToPosStates - 1) << kNumPosSlotBits));  }
+				if(len < kNumLenToPosStates) { p = probs; prob = p + PROB_BYTES * (PosSlot + (len << kNumPosSlotBits));  }
+				else { p = probs; prob = p + PROB_BYTES * (PosSlot + ((kNumLenToPosStates - 1) << kNumPosSlotBits));  }
 
 				distance = 1;
 
@@ -759,6 +1427,7 @@ void LzmaDec_DecodeReal(uint32_t limit, uint8_t *bufLimit)
 					}
 
 					bound = (range >> kNumBitModelTotalBits) * ttt;
+#if defined(__M2__)
 					if(code < bound)
 					{
 						range = bound;
@@ -772,6 +1441,14 @@ void LzmaDec_DecodeReal(uint32_t limit, uint8_t *bufLimit)
 						prob[distance] = (BITS32 & ((ttt - (ttt >> kNumMoveBits)))) | (HIGHBITS & prob[distance]);
 						distance = (distance + distance) + 1;
 					}
+#else
+					/* Branchless: bitMask is all ones if the bit is 1. */
+					bitMask = 0 - (uint32_t)(code >= bound);
+					range = (bound & ~bitMask) | ((range - bound) & bitMask);
+					code = code - (bound & bitMask);
+					prob[distance] = ttt + (((kBitModelTotal - ttt) >> kNumMoveBits) & ~bitMask) - ((ttt >> kNumMoveBits) & bitMask);
+					distance = (distance + distance) + (bitMask & 1);
+#endif
 				} while(distance < (1 << 6));
 
 				distance = distance - (1 << 6);
@@ -786,7 +1463,7 @@ void LzmaDec_DecodeReal(uint32_t limit, uint8_t *bufLimit)
 					{
 						distance = distance << numDirectBits;
 						p = probs;
-						prob = p + 4 * (SpecPos + distance - posSlot - 1);
+						prob = p + PROB_BYTES * (SpecPos + distance - posSlot - 1);
 						mask = 1;
 						i = 1;
 
@@ -846,7 +1523,7 @@ void LzmaDec_DecodeReal(uint32_t limit, uint8_t *bufLimit)
 						} while(numDirectBits != 0);
 
 						p = probs;
-						prob = p + 4 * Align;
+						prob = p + PROB_BYTES * Align;
 						distance = distance << kNumAlignBits;
 						i = 1;
 						ttt = prob[i];
@@ -982,28 +1659,14 @@ void LzmaDec_DecodeReal(uint32_t limit, uint8_t *bufLimit)
 			if(rem < len) curLen = rem;
 			else curLen = len;
 
-			if(diclPos < rep0) pos = (diclPos - rep0) + diclLimit;
+			if(diclPos < rep0) pos = (diclPos - rep0) + dicBufSize;
 			else pos = diclPos - rep0;
 
 			processedPos = processedPos + curLen;
 			len = len - curLen;
 
-			/* TODO(pts): ASSERT(len == curLen);, simplify buffering code. */
-			/* + cannot overflow. */
-			if((diclPos + curLen) > global->allocCapacity)
-			{
-				global->dicfPos = diclPos;
-				FlushDiscardGrowDic(curLen);
-
-				pos = pos + global->dicfPos - diclPos;
-				dicl = global->dicf;
-				diclLimit = global->dicfLimit;
-				diclPos = global->dicfPos;
-			}
-
-			if((pos + curLen) <= diclLimit)
+			if((pos + curLen) <= dicBufSize)
 			{
-				require(diclPos > pos, "diclPos > pos");
 				require(curLen > 0, "curLen > 0");
 				i = 0;
 				n = curLen;
@@ -1024,7 +1687,7 @@ void LzmaDec_DecodeReal(uint32_t limit, uint8_t *bufLimit)
 					diclPos = diclPos + 1;
 					pos = pos + 1;
 
-					if(pos == diclLimit)
+					if(pos == dicBufSize)
 					{
 						pos = 0;
 					}
@@ -1041,69 +1704,61 @@ void LzmaDec_DecodeReal(uint32_t limit, uint8_t *bufLimit)
 		buf = buf + 1;
 	}
 
-	global->buf = buf;
-	global->range = range;
-	global->code = code;
-	global->remainLen = len;
-	global->dicfPos = diclPos;
-	global->processedPos = processedPos;
-	global->reps[0] = rep0;
-	global->reps[1] = rep1;
-	global->reps[2] = rep2;
-	global->reps[3] = rep3;
-	global->state = state;
+	dec->buf = buf;
+	dec->range = range;
+	dec->code = code;
+	dec->remainLen = len;
+	dec->dicfPos = diclPos;
+	dec->processedPos = processedPos;
+	dec->reps[0] = rep0;
+	dec->reps[1] = rep1;
+	dec->reps[2] = rep2;
+	dec->reps[3] = rep3;
+	dec->state = state;
 }
 
-void LzmaDec_WriteRem(uint32_t limit)
+void LzmaDec_WriteRem(struct CLzmaDec* dec, uint32_t limit)
 {
 	uint8_t *dicl;
 	uint32_t diclPos;
-	uint32_t diclLimit;
+	uint32_t dicBufSize;
 	uint32_t len;
 	uint32_t rep0;
 
-	if(global->remainLen != 0 && global->remainLen < kMatchSpecLenStart)
+	if(dec->remainLen != 0 && dec->remainLen < kMatchSpecLenStart)
 	{
-		dicl = global->dicf;
-		diclPos = global->dicfPos;
-		diclLimit = global->dicfLimit;
-		len = global->remainLen;
-		rep0 = global->reps[0];
+		dicl = dec->dicf;
+		diclPos = dec->dicfPos;
+		dicBufSize = dec->dicBufSize;
+		len = dec->remainLen;
+		rep0 = dec->reps[0];
 
 		if(limit - diclPos < len)
 		{
 			len = limit - diclPos;
 		}
 
-		if(diclPos + len > global->allocCapacity)
-		{
-			FlushDiscardGrowDic(len);
-			dicl = global->dicf;
-			diclLimit = global->dicfLimit;
-			diclPos = global->dicfPos;
-		}
-
-		if((global->checkDicSize == 0) && ((global->dicSize - global->processedPos) <= len))
+		if((dec->checkDicSize == 0) && ((dec->dicSize - dec->processedPos) <= len))
 		{
-			global->checkDicSize = global->dicSize;
+			dec->checkDicSize = dec->dicSize;
 		}
 
-		global->processedPos = global->processedPos + len;
-		global->remainLen = global->remainLen - len;
+		dec->processedPos = dec->processedPos + len;
+		dec->remainLen = dec->remainLen - len;
 
 		while(len != 0)
 		{
 			len = len - 1;
-			if(diclPos < rep0) dicl[diclPos] = (0xFF & dicl[(diclPos - rep0) + diclLimit]) | ((~0xFF) & dicl[diclPos]);
+			if(diclPos < rep0) dicl[diclPos] = (0xFF & dicl[(diclPos - rep0) + dicBufSize]) | ((~0xFF) & dicl[diclPos]);
 			else dicl[diclPos] = (0xFF & dicl[diclPos - rep0]) | ((~0xFF) & dicl[diclPos]);
 			diclPos = diclPos + 1;
 		}
 
-		global->dicfPos = diclPos;
+		dec->dicfPos = diclPos;
 	}
 }
 
-void LzmaDec_DecodeReal2(uint32_t limit, uint8_t *bufLimit)
+void LzmaDec_DecodeReal2(struct CLzmaDec* dec, uint32_t limit, uint8_t *bufLimit)
 {
 	uint32_t limit2;
 	uint32_t rem;
@@ -1112,41 +1767,41 @@ void LzmaDec_DecodeReal2(uint32_t limit, uint8_t *bufLimit)
 	{
 		limit2 = limit;
 
-		if(global->checkDicSize == 0)
+		if(dec->checkDicSize == 0)
 		{
-			rem = global->dicSize - global->processedPos;
+			rem = dec->dicSize - dec->processedPos;
 
-			if((limit - global->dicfPos) > rem)
+			if((limit - dec->dicfPos) > rem)
 			{
-				limit2 = global->dicfPos + rem;
+				limit2 = dec->dicfPos + rem;
 			}
 		}
 
-		LzmaDec_DecodeReal(limit2, bufLimit);
+		LzmaDec_DecodeReal(dec, limit2, bufLimit);
 
-		if(global->processedPos >= global->dicSize)
+		if(dec->processedPos >= dec->dicSize)
 		{
-			global->checkDicSize = global->dicSize;
+			dec->checkDicSize = dec->dicSize;
 		}
 
-		LzmaDec_WriteRem(limit);
-	} while((global->dicfPos < limit) && (global->buf < bufLimit) && (global->remainLen < kMatchSpecLenStart));
+		LzmaDec_WriteRem(dec, limit);
+	} while((dec->dicfPos < limit) && (dec->buf < bufLimit) && (dec->remainLen < kMatchSpecLenStart));
 
-	if(global->remainLen > kMatchSpecLenStart)
+	if(dec->remainLen > kMatchSpecLenStart)
 	{
-		global->remainLen = kMatchSpecLenStart;
+		dec->remainLen = kMatchSpecLenStart;
 	}
 }
 
-int LzmaDec_TryDummy(uint8_t* buf, uint32_t inSize)
+int LzmaDec_TryDummy(struct CLzmaDec* dec, uint8_t* buf, uint32_t inSize)
 {
-	uint32_t range = global->range;
-	uint32_t code = global->code;
+	uint32_t range = dec->range;
+	uint32_t code = dec->code;
 	uint8_t* bufLimit = buf + inSize;
-	uint32_t* probs = global->probs;
-	uint32_t state = global->state;
+	CLzmaProb* probs = dec->probs;
+	uint32_t state = dec->state;
 	int res;
-	uint32_t* prob;
+	CLzmaProb* prob;
 	uint32_t bound;
 	uint32_t ttt;
 	uint32_t posState;
@@ -1155,19 +1810,19 @@ int LzmaDec_TryDummy(uint8_t* buf, uint32_t inSize)
 	uint32_t matchByte;
 	uint32_t offs;
 	uint32_t bit;
-	uint32_t* probLit;
+	CLzmaProb* probLit;
 	uint32_t len;
 	uint32_t limit;
 	uint32_t offset;
-	uint32_t* probLen;
+	CLzmaProb* probLen;
 	uint32_t posSlot;
 	uint32_t numDirectBits;
 	uint32_t i;
 	uint8_t* p;
 
-	posState = (global->processedPos) & ((1 << global->pb) - 1);
+	posState = (dec->processedPos) & ((1 << dec->pb) - 1);
 	p = probs;
-	prob = p + 4 * (IsMatch + (state << kNumPosBitsMax) + posState);
+	prob = p + PROB_BYTES * (IsMatch + (state << kNumPosBitsMax) + posState);
 	ttt = prob[0];
 
 	if(range < kTopValue)
@@ -1188,21 +1843,21 @@ int LzmaDec_TryDummy(uint8_t* buf, uint32_t inSize)
 	{
 		range = bound;
 		p = probs;
-		prob = p + 4 * Literal;
+		prob = p + PROB_BYTES * Literal;
 
-		if(global->checkDicSize != 0 || global->processedPos != 0)
+		if(dec->checkDicSize != 0 || dec->processedPos != 0)
 		{
-			hold = (((global->processedPos) & ((1 << (global->lp)) - 1)) << global->lc);
-			if(global->dicfPos == 0)
+			hold = (((dec->processedPos) & ((1 << (dec->lp)) - 1)) << dec->lc);
+			if(dec->dicfPos == 0)
 			{
-				hold = hold + ((0xFF & global->dicf[global->dicfLimit - 1]) >> (8 - global->lc));
+				hold = hold + ((0xFF & dec->dicf[dec->dicBufSize - 1]) >> (8 - dec->lc));
 			}
 			else
 			{
-				hold = hold + ((0xFF & global->dicf[global->dicfPos - 1]) >> (8 - global->lc));
+				hold = hold + ((0xFF & dec->dicf[dec->dicfPos - 1]) >> (8 - dec->lc));
 			}
 			p = prob;
-			prob = p + 4 * (LZMA_LIT_SIZE * hold);
+			prob = p + PROB_BYTES * (LZMA_LIT_SIZE * hold);
 		}
 
 		if(state < kNumLitStates)
@@ -1242,12 +1897,12 @@ int LzmaDec_TryDummy(uint8_t* buf, uint32_t inSize)
 		}
 		else
 		{
-			if(global->dicfPos < (global->reps[0] & BITS32))
+			if(dec->dicfPos < (dec->reps[0] & BITS32))
 			{
-				hold = global->dicfPos - (global->reps[0] & BITS32) + global->dicfLimit;
+				hold = dec->dicfPos - (dec->reps[0] & BITS32) + dec->dicBufSize;
 			}
-			else hold = global->dicfPos - (global->reps[0] & BITS32);
-			matchByte = 0xFF & global->dicf[hold];
+			else hold = dec->dicfPos - (dec->reps[0] & BITS32);
+			matchByte = 0xFF & dec->dicf[hold];
 
 			offs = 0x100;
 			symbol = 1;
@@ -1257,7 +1912,7 @@ int LzmaDec_TryDummy(uint8_t* buf, uint32_t inSize)
 				matchByte = matchByte << 1;
 				bit = (matchByte & offs);
 				p = prob;
-				probLit = p + 4 * (offs + bit + symbol);
+				probLit = p + PROB_BYTES * (offs + bit + symbol);
 				ttt = probLit[0];
 
 				if(range < kTopValue)
@@ -1297,7 +1952,7 @@ int LzmaDec_TryDummy(uint8_t* buf, uint32_t inSize)
 		range = range - bound;
 		code = code - bound;
 		p = probs;
-		prob = p + 4 * (IsRep + state);
+		prob = p + PROB_BYTES * (IsRep + state);
 		ttt = prob[0];
 
 		if(range < kTopValue)
@@ -1319,7 +1974,7 @@ int LzmaDec_TryDummy(uint8_t* buf, uint32_t inSize)
 			range = bound;
 			state = 0;
 			p = probs;
-			prob = p + 4 * LenCoder;
+			prob = p + PROB_BYTES * LenCoder;
 			res = DUMMY_MATCH;
 		}
 		else
@@ -1328,7 +1983,7 @@ int LzmaDec_TryDummy(uint8_t* buf, uint32_t inSize)
 			code = code - bound;
 			res = DUMMY_REP;
 			p = probs;
-			prob = p + 4 * (IsRepG0 + state);
+			prob = p + PROB_BYTES * (IsRepG0 + state);
 			ttt = prob[0];
 
 			if(range < kTopValue)
@@ -1349,7 +2004,7 @@ int LzmaDec_TryDummy(uint8_t* buf, uint32_t inSize)
 			{
 				range = bound;
 				p = probs;
-				prob = p + 4 * (IsRep0Long + (state << kNumPosBitsMax) + posState);
+				prob = p + PROB_BYTES * (IsRep0Long + (state << kNumPosBitsMax) + posState);
 				ttt = prob[0];
 
 				if(range < kTopValue)
@@ -1395,7 +2050,7 @@ int LzmaDec_TryDummy(uint8_t* buf, uint32_t inSize)
 				range = range - bound;
 				code = code - bound;
 				p = probs;
-				prob = p + 4 * (IsRepG1 + state);
+				prob = p + PROB_BYTES * (IsRepG1 + state);
 				ttt = prob[0];
 
 				if(range < kTopValue)
@@ -1421,7 +2076,7 @@ int LzmaDec_TryDummy(uint8_t* buf, uint32_t inSize)
 					range = range - bound;
 					code = code - bound;
 					p = probs;
-					prob = p + 4 * (IsRepG2 + state);
+					prob = p + PROB_BYTES * (IsRepG2 + state);
 					ttt = prob[0];
 
 					if(range < kTopValue)
@@ -1452,11 +2107,11 @@ int LzmaDec_TryDummy(uint8_t* buf, uint32_t inSize)
 
 			state = kNumStates;
 			p = probs;
-			prob = p + 4 * RepLenCoder;
+			prob = p + PROB_BYTES * RepLenCoder;
 		}
 
 		p = prob;
-		probLen = p + 4 * LenChoice;
+		probLen = p + PROB_BYTES * LenChoice;
 		ttt = probLen[0];
 
 		if(range < kTopValue)
@@ -1477,7 +2132,7 @@ int LzmaDec_TryDummy(uint8_t* buf, uint32_t inSize)
 		{
 			range = bound;
 			p = prob;
-			probLen = p + 4 * (LenLow + (posState << kLenNumLowBits));
+			probLen = p + PROB_BYTES * (LenLow + (posState << kLenNumLowBits));
 			offset = 0;
 			limit = 1 << kLenNumLowBits;
 		}
@@ -1486,7 +2141,7 @@ int LzmaDec_TryDummy(uint8_t* buf, uint32_t inSize)
 			range = range - bound;
 			code = code - bound;
 			p = prob;
-			probLen = p + 4 * LenChoice2;
+			probLen = p + PROB_BYTES * LenChoice2;
 			ttt = probLen[0];
 
 			if(range < kTopValue)
@@ -1507,7 +2162,7 @@ int LzmaDec_TryDummy(uint8_t* buf, uint32_t inSize)
 			{
 				range = bound;
 				p = prob;
-				probLen = p + 4 * (LenMid + (posState << kLenNumMidBits));
+				probLen = p + PROB_BYTES * (LenMid + (posState << kLenNumMidBits));
 				offset = kLenNumLowSymbols;
 				limit = 1 << kLenNumMidBits;
 			}
@@ -1515,7 +2170,7 @@ int LzmaDec_TryDummy(uint8_t* buf, uint32_t inSize)
 			{
 				range = range - bound;
 				code = code - bound;
-				probLen = p + 4 * LenHigh;
+				probLen = p + PROB_BYTES * LenHigh;
 				offset = kLenNumLowSymbols + kLenNumMidSymbols;
 				limit = 1 << kLenNumHighBits;
 			}
@@ -1562,7 +2217,7 @@ int LzmaDec_TryDummy(uint8_t* buf, uint32_t inSize)
 			else hold = (kNumLenToPosStates - 1) << kNumPosSlotBits;
 
 			p = probs;
-			prob = p + 4 * (PosSlot + hold);
+			prob = p + PROB_BYTES * (PosSlot + hold);
 			posSlot = 1;
 
 			do
@@ -1605,7 +2260,7 @@ int LzmaDec_TryDummy(uint8_t* buf, uint32_t inSize)
 				if(posSlot < kEndPosModelIndex)
 				{
 					p = probs;
-					prob = p + 4 * (SpecPos + ((2 | (posSlot & 1)) << numDirectBits) - posSlot - 1);
+					prob = p + PROB_BYTES * (SpecPos + ((2 | (posSlot & 1)) << numDirectBits) - posSlot - 1);
 				}
 				else
 				{
@@ -1631,7 +2286,7 @@ int LzmaDec_TryDummy(uint8_t* buf, uint32_t inSize)
 					} while(numDirectBits != 0);
 
 					p = probs;
-					prob = p + 4 * Align;
+					prob = p + PROB_BYTES * Align;
 					numDirectBits = kNumAlignBits;
 				}
 
@@ -1689,52 +2344,57 @@ int LzmaDec_TryDummy(uint8_t* buf, uint32_t inSize)
 }
 
 
-void LzmaDec_InitRc(uint8_t* data)
+void LzmaDec_InitRc(struct CLzmaDec* dec, uint8_t* data)
 {
-	global->code = ((0xFF & data[1]) << 24) | ((0xFF & data[2]) << 16) | ((0xFF & data[3]) << 8) | (0xFF & data[4]);
-	global->range = BITS32;
-	global->needFlush = FALSE;
+	dec->code = ((0xFF & data[1]) << 24) | ((0xFF & data[2]) << 16) | ((0xFF & data[3]) << 8) | (0xFF & data[4]);
+	dec->range = BITS32;
+	dec->needFlush = FALSE;
 }
 
-void LzmaDec_InitDicAndState(int initDic, int initState)
+void LzmaDec_InitDicAndState(struct CLzmaDec* dec, int initDic, int initState)
 {
-	global->needFlush = TRUE;
-	global->remainLen = 0;
-	global->tempBufSize = 0;
+	dec->needFlush = TRUE;
+	dec->remainLen = 0;
+	dec->tempBufSize = 0;
 
 	if(initDic)
 	{
-		global->processedPos = 0;
-		global->checkDicSize = 0;
-		global->needInitLzma = TRUE;
+		dec->processedPos = 0;
+		dec->checkDicSize = 0;
+		dec->needInitLzma = TRUE;
 	}
 
 	if(initState)
 	{
-		global->needInitLzma = TRUE;
+		dec->needInitLzma = TRUE;
 	}
 }
 
-void LzmaDec_InitStateReal()
+void LzmaDec_InitStateReal(struct CLzmaDec* dec)
 {
-	uint32_t numProbs = Literal + (LZMA_LIT_SIZE << (global->lc + global->lp));
+	uint32_t numProbs = Literal + (LZMA_LIT_SIZE << (dec->lc + dec->lp));
 	uint32_t i;
-	uint32_t* probs = global->probs;
+	CLzmaProb* probs = dec->probs;
 
 	for(i = 0; i < numProbs; i = i + 1)
 	{
 		probs[i] = (BITS32 & (kBitModelTotal >> 1)) | (HIGHBITS & probs[i]);
 	}
 
-	global->reps[0] = 1; global->reps[1] = 1; global->reps[2] = 1; global->reps[3] = 1;
-	global->state = 0;
-	global->needInitLzma = FALSE;
+	dec->reps[0] = 1; dec->reps[1] = 1; dec->reps[2] = 1; dec->reps[3] = 1;
+	dec->state = 0;
+	dec->needInitLzma = FALSE;
 }
 
-uint32_t LzmaDec_DecodeToDic(uint8_t* src, uint32_t srcLen)
+/* Decodes from src until dicfPos reaches dicfLimit or the stream ends.
+ * srcLen[0] is the number of input bytes available on entry, and the number
+ * consumed on return. Unless finishMode is set, reaching dicfLimit just
+ * returns SZ_OK, and decoding can continue after the caller made room.
+ */
+uint32_t LzmaDec_DecodeToDic(struct CLzmaDec* dec, uint8_t* src, uint32_t* srcLen, int finishMode)
 {
-	uint32_t srcLen0 = srcLen;
-	uint32_t inSize = srcLen;
+	uint32_t srcLen0 = srcLen[0];
+	uint32_t inSize = srcLen[0];
 	int checkEndMarkNow;
 	uint32_t processed;
 	uint8_t *bufLimit;
@@ -1742,63 +2402,65 @@ uint32_t LzmaDec_DecodeToDic(uint8_t* src, uint32_t srcLen)
 	uint32_t rem;
 	uint32_t lookAhead;
 
-	srcLen = 0;
-	LzmaDec_WriteRem(global->dicfLimit);
+	srcLen[0] = 0;
+	LzmaDec_WriteRem(dec, dec->dicfLimit);
 
-	while(global->remainLen != kMatchSpecLenStart)
+	while(dec->remainLen != kMatchSpecLenStart)
 	{
-		if(global->needFlush)
+		if(dec->needFlush)
 		{
-			while(inSize > 0 && global->tempBufSize < RC_INIT_SIZE)
+			while(inSize > 0 && dec->tempBufSize < RC_INIT_SIZE)
 			{
-				global->tempBuf[global->tempBufSize] = 0xFF & src[0];
-				global->tempBufSize = global->tempBufSize + 1;
+				dec->tempBuf[dec->tempBufSize] = 0xFF & src[0];
+				dec->tempBufSize = dec->tempBufSize + 1;
 				src = src + 1;
-				srcLen = srcLen + 1;
+				srcLen[0] = srcLen[0] + 1;
 				inSize = inSize - 1;
 			}
 
-			if(global->tempBufSize < RC_INIT_SIZE)
+			if(dec->tempBufSize < RC_INIT_SIZE)
 			{
-				if(srcLen != srcLen0) return SZ_ERROR_NEEDS_MORE_INPUT_PARTIAL;
+				if(srcLen[0] != srcLen0) return SZ_ERROR_NEEDS_MORE_INPUT_PARTIAL;
 				return SZ_ERROR_NEEDS_MORE_INPUT;
 			}
 
-			if((0xFF & global->tempBuf[0]) != 0) return SZ_ERROR_DATA;
+			if((0xFF & dec->tempBuf[0]) != 0) return SZ_ERROR_DATA;
 
-			LzmaDec_InitRc(global->tempBuf);
-			global->tempBufSize = 0;
+			LzmaDec_InitRc(dec, dec->tempBuf);
+			dec->tempBufSize = 0;
 		}
 
 		checkEndMarkNow = FALSE;
 
-		if(global->dicfPos >= global->dicfLimit)
+		if(dec->dicfPos >= dec->dicfLimit)
 		{
-			if((global->remainLen == 0) && (global->code == 0))
+			if(!finishMode) return SZ_OK;
+
+			if((dec->remainLen == 0) && (dec->code == 0))
 			{
-				if(srcLen != srcLen0) return SZ_ERROR_CHUNK_NOT_CONSUMED;
+				if(srcLen[0] != srcLen0) return SZ_ERROR_CHUNK_NOT_CONSUMED;
 				return SZ_OK /* MAYBE_FINISHED_WITHOUT_MARK */;
 			}
 
-			if(global->remainLen != 0) return SZ_ERROR_NOT_FINISHED;
+			if(dec->remainLen != 0) return SZ_ERROR_NOT_FINISHED;
 			checkEndMarkNow = TRUE;
 		}
 
-		if(global->needInitLzma) LzmaDec_InitStateReal();
+		if(dec->needInitLzma) LzmaDec_InitStateReal(dec);
 
-		if(global->tempBufSize == 0)
+		if(dec->tempBufSize == 0)
 		{
 
 			if(inSize < LZMA_REQUIRED_INPUT_MAX || checkEndMarkNow)
 			{
-				dummyRes = LzmaDec_TryDummy(src, inSize);
+				dummyRes = LzmaDec_TryDummy(dec, src, inSize);
 
 				if(dummyRes == DUMMY_ERROR)
 				{
-					memcpy(global->tempBuf, src, inSize);
-					global->tempBufSize = inSize;
-					srcLen += inSize;
-					if(srcLen != srcLen0) return SZ_ERROR_NEEDS_MORE_INPUT_PARTIAL;
+					memcpy(dec->tempBuf, src, inSize);
+					dec->tempBufSize = inSize;
+					srcLen[0] = srcLen[0] + inSize;
+					if(srcLen[0] != srcLen0) return SZ_ERROR_NEEDS_MORE_INPUT_PARTIAL;
 					return SZ_ERROR_NEEDS_MORE_INPUT;
 				}
 
@@ -1810,148 +2472,216 @@ uint32_t LzmaDec_DecodeToDic(uint8_t* src, uint32_t srcLen)
 				bufLimit = src + inSize - LZMA_REQUIRED_INPUT_MAX;
 			}
 
-			global->buf = src;
-			LzmaDec_DecodeReal2(global->dicfLimit, bufLimit);
-			processed = (global->buf - src);
-			srcLen = srcLen + processed;
+			dec->buf = src;
+			LzmaDec_DecodeReal2(dec, dec->dicfLimit, bufLimit);
+			processed = (dec->buf - src);
+			srcLen[0] = srcLen[0] + processed;
 			src = src + processed;
 			inSize = inSize - processed;
 		}
 		else
 		{
-			rem = global->tempBufSize;
+			rem = dec->tempBufSize;
 			lookAhead = 0;
 
 			while((rem < LZMA_REQUIRED_INPUT_MAX) && (lookAhead < inSize))
 			{
-				global->tempBuf[rem] = 0xFF & src[lookAhead];
+				dec->tempBuf[rem] = 0xFF & src[lookAhead];
 				rem = rem + 1;
 				lookAhead = lookAhead + 1;
 			}
 
-			global->tempBufSize = rem;
+			dec->tempBufSize = rem;
 
 			if(rem < LZMA_REQUIRED_INPUT_MAX || checkEndMarkNow)
 			{
-				dummyRes = LzmaDec_TryDummy(global->tempBuf, rem);
+				dummyRes = LzmaDec_TryDummy(dec, dec->tempBuf, rem);
 
 				if(dummyRes == DUMMY_ERROR)
 				{
-					srcLen = srcLen + lookAhead;
-					if(srcLen != srcLen0) return SZ_ERROR_NEEDS_MORE_INPUT_PARTIAL;
+					srcLen[0] = srcLen[0] + lookAhead;
+					if(srcLen[0] != srcLen0) return SZ_ERROR_NEEDS_MORE_INPUT_PARTIAL;
 					return SZ_ERROR_NEEDS_MORE_INPUT;
 				}
 
 				if(checkEndMarkNow && dummyRes != DUMMY_MATCH) return SZ_ERROR_NOT_FINISHED;
 			}
 
-			global->buf = global->tempBuf;
-			LzmaDec_DecodeReal2(global->dicfLimit, global->buf);
-			lookAhead = lookAhead - (rem - (global->buf - global->tempBuf));
-			srcLen = srcLen + lookAhead;
+			dec->buf = dec->tempBuf;
+			LzmaDec_DecodeReal2(dec, dec->dicfLimit, dec->buf);
+			lookAhead = lookAhead - (rem - (dec->buf - dec->tempBuf));
+			srcLen[0] = srcLen[0] + lookAhead;
 			src = src + lookAhead;
 			inSize = inSize - lookAhead;
-			global->tempBufSize = 0;
+			dec->tempBufSize = 0;
 		}
 	}
 
-	if(global->code != 0) return SZ_ERROR_DATA;
+	if(dec->code != 0) return SZ_ERROR_DATA;
 	return SZ_ERROR_FINISHED_WITH_MARK;
 }
 
 
-
 /* Tries to preread r bytes to the read buffer. Returns the number of bytes
  * available in the read buffer. If smaller than r, that indicates EOF.
  *
- * Doesn't try to preread more than absolutely necessary, to avoid copies in
- * the future.
+ * Each read(2) asks for the whole free tail of the read buffer, so there is
+ * usually one system call per 64 KiB of input.
  *
  * Works only if r <= sizeof(readBuf).
  */
-uint32_t Preread(uint32_t r)
+uint32_t Preread(struct CLzmaDec* dec, uint32_t r)
 {
-	uint32_t hold;
-	uint32_t p = global->readEnd - global->readCur;
+	int n;
+	uint32_t p = dec->readEnd - dec->readCur;
 	require(r <= sizeof_readBuf, "r <= sizeof_readBuf");
 
-	if(p < r)     /* Not enough pending available. */
+	/* Not enough pending available, and more could be read. */
+	if((p < r) && (dec->source >= 0))
 	{
-		if(global->readBuf + sizeof_readBuf - global->readCur + 0 < r)
+		if(dec->readBuf + sizeof_readBuf - dec->readCur + 0 < r)
 		{
 			/* If no room for r bytes to the end, discard bytes from the beginning. */
-			global->readBuf = memmove(global->readBuf, global->readCur, p);
-			global->readEnd = global->readBuf + p;
-			global->readCur = global->readBuf;
+			dec->readBuf = memmove(dec->readBuf, dec->readCur, p);
+			dec->readEnd = dec->readBuf + p;
+			dec->readCur = dec->readBuf;
 		}
 
 		while(p < r)
 		{
 			/* our single spot for reading input */
-			hold = fgetc(source);
-			pos = pos + 1;
+			n = read(dec->source, dec->readEnd, dec->readBuf + sizeof_readBuf - dec->readEnd);
 			/* EOF or error on input. */
-			if(EOF == hold) break;
+			if(n <= 0) break;
 
-			/* otherwise just add it */
-			global->readEnd[0] = (0xFF & hold) | ((~0xFF) & global->readEnd[0]);
-			global->readEnd = global->readEnd + 1;
-			p = p + 1;
+			dec->readEnd = dec->readEnd + n;
+			p = p + n;
 		}
 	}
 
 	return p;
 }
 
-void IgnoreVarint()
+void IgnoreVarint(struct CLzmaDec* dec)
 {
-	while((0xFF & global->readCur[0]) >= 0x80)
+	while((0xFF & dec->readCur[0]) >= 0x80)
 	{
-		global->readCur = global->readCur + 1;
+		dec->readCur = dec->readCur + 1;
 	}
-	global->readCur = global->readCur + 1;
+	dec->readCur = dec->readCur + 1;
 }
 
-uint32_t IgnoreZeroBytes(uint32_t c)
+uint32_t IgnoreZeroBytes(struct CLzmaDec* dec, uint32_t c)
 {
 	while(c > 0)
 	{
-		if((0xFF & global->readCur[0]) != 0)
+		if((0xFF & dec->readCur[0]) != 0)
 		{
-			global->readCur = global->readCur + 1;
+			dec->readCur = dec->readCur + 1;
 			return SZ_ERROR_BAD_PADDING;
 		}
-		global->readCur = global->readCur + 1;
+		dec->readCur = dec->readCur + 1;
 		c = c - 1;
 	}
 
 	return SZ_OK;
 }
 
-uint32_t GetLE4(uint8_t *p)
+/* Reads a varint at readCur, which must be preread. Values of 2**28 and
+ * above come back as BITS32, they are only compared.
+ */
+uint32_t ReadVarint(struct CLzmaDec* dec)
 {
-	return (0xFF & p[0]) | (0xFF & p[1]) << 8 | (0xFF & p[2]) << 16 | (0xFF & p[3]) << 24;
-}
+	uint32_t value = 0;
+	uint32_t shift = 0;
+	uint32_t b;
 
-/* Expects global->dicSize be set already. Can be called before or after InitProp. */
-void InitDecode()
-{
-	/* global->lc = global->pb = global->lp = 0; */  /* needinitprop will initialize it */
-	global->dicfLimit = 0;  /* We'll increment it later. */
-	global->needInitDic = TRUE;
-	global->needInitState = TRUE;
-	global->needInitProp = TRUE;
-	global->writtenPos = 0;
-	global->writeRemaining = BITS32;
-	global->discardedSize = 0;
-	global->dicfPos = 0;
-	LzmaDec_InitDicAndState(TRUE, TRUE);
+	do
+	{
+		b = 0xFF & dec->readCur[0];
+		dec->readCur = dec->readCur + 1;
+		if(shift < 28) value = value | ((b & 0x7F) << shift);
+		else if((b & 0x7F) != 0) value = BITS32;
+		shift = shift + 7;
+	} while((b >= 0x80) && (shift < 63));
+
+	return value;
 }
 
-uint32_t InitProp(uint8_t b)
+/* Skips the index after the last block of a stream and the stream footer.
+ * The index CRC32, its number of records against the numBlocks blocks
+ * decoded, and the footer against the stream header are verified.
+ */
+uint32_t SkipXzIndex(struct CLzmaDec* dec, uint32_t numBlocks, uint32_t checkType)
 {
-	uint32_t lc;
-	uint32_t lp;
+	uint32_t crc;
+	uint32_t indexSize = 1;
+	uint32_t numVarints;
+	uint32_t n;
+	uint8_t* mark;
+
+	/* The index indicator, preread with the block header size it stands for. */
+	crc = Crc32(0, dec->readCur, 1);
+	dec->readCur = dec->readCur + 1;
+
+	/* The number of records, then two varints per record. */
+	numVarints = 1;
+
+	while(numVarints != 0)
+	{
+		/* a varint is at most 9 bytes long, but may be shorter */
+		Preread(dec, 9);
+		mark = dec->readCur;
+		n = ReadVarint(dec);
+
+		if(indexSize == 1)
+		{
+			if(n != numBlocks) return SZ_ERROR_DATA;
+			numVarints = 2 * n + 1;
+		}
+
+		n = dec->readCur - mark;
+		crc = Crc32(crc, mark, n);
+		indexSize = indexSize + n;
+		numVarints = numVarints - 1;
+	}
+
+	/* Padding to a multiple of 4, the CRC32 and the stream footer. */
+	n = (4 - (indexSize & 3)) & 3;
+	if(Preread(dec, n + 4 + 12) < n + 4 + 12) return SZ_ERROR_INPUT_EOF;
+	crc = Crc32(crc, dec->readCur, n);
+	if(IgnoreZeroBytes(dec, n) != 0) return SZ_ERROR_BAD_PADDING;
+	indexSize = indexSize + n + 4;
+	if(GetLE4(dec->readCur) != crc) return SZ_ERROR_CRC;
+	dec->readCur = dec->readCur + 4;
+
+	if(Crc32(0, dec->readCur + 4, 6) != GetLE4(dec->readCur)) return SZ_ERROR_CRC;
+	if(((GetLE4(dec->readCur + 4) + 1) << 2) != indexSize) return SZ_ERROR_DATA;
+	if((0 != (0xFF & dec->readCur[8])) || (checkType != (0xFF & dec->readCur[9]))) return SZ_ERROR_BAD_STREAM_FLAGS;
+	if(('Y' != dec->readCur[10]) || ('Z' != dec->readCur[11])) return SZ_ERROR_BAD_MAGIC;
+	dec->readCur = dec->readCur + 12;
+	return SZ_OK;
+}
+
+/* Expects dec->dicSize be set already. Can be called before or after InitProp. */
+void InitDecode(struct CLzmaDec* dec)
+{
+	/* dec->lc = dec->pb = dec->lp = 0; */  /* needinitprop will initialize it */
+	dec->dicfLimit = 0;  /* We'll increment it later. */
+	dec->needInitDic = TRUE;
+	dec->needInitState = TRUE;
+	dec->needInitProp = TRUE;
+	dec->writtenPos = 0;
+	dec->writeRemaining = BITS32;
+	dec->discardedSize = 0;
+	dec->dicfPos = 0;
+	LzmaDec_InitDicAndState(dec, TRUE, TRUE);
+}
+
+uint32_t InitProp(struct CLzmaDec* dec, uint8_t b)
+{
+	uint32_t lc;
+	uint32_t lp;
 
 	if(b >= (9 * 5 * 5))
 	{
@@ -1960,7 +2690,7 @@ uint32_t InitProp(uint8_t b)
 
 	lc = b % 9;
 	b = b / 9;
-	global->pb = b / 5;
+	dec->pb = b / 5;
 	lp = b % 5;
 
 	if(lc + lp > LZMA2_LCLP_MAX)
@@ -1968,370 +2698,475 @@ uint32_t InitProp(uint8_t b)
 		return SZ_ERROR_BAD_LCLPPB_PROP;
 	}
 
-	global->lc = lc;
-	global->lp = lp;
-	global->needInitProp = FALSE;
+	dec->lc = lc;
+	dec->lp = lp;
+	dec->needInitProp = FALSE;
 	return SZ_OK;
 }
 
 
-/* Reads .xz or .lzma data from source, writes uncompressed bytes to destination,
- * uses CLzmaDec.dic. It verifies some aspects of the file format (so it
- * can't be tricked to an infinite loop etc.), it doesn't verify checksums
- * (e.g. CRC32).
+/* Decodes an LZMA2 chunk of us uncompressed bytes from its cs bytes at
+ * readCur, which must all be preread. It is done in pieces when the chunk
+ * wraps around the end of the circular dictionary.
  */
-uint32_t DecompressXzOrLzma()
+uint32_t DecodeChunk(struct CLzmaDec* dec, int compressed, uint32_t us, uint32_t cs)
 {
-	uint8_t checksumSize;
+	uint8_t* src = dec->readCur;
+	uint32_t srcLen;
+	uint32_t n;
+	uint32_t result;
+
+	while(TRUE)
+	{
+		if(dec->dicfPos == dec->dicBufSize) FlushWrap(dec);
+
+		n = dec->dicBufSize - dec->dicfPos;
+		if(n > us) n = us;
+		dec->dicfLimit = dec->dicfPos + n;
+		GrowDic(dec, dec->dicfLimit);
+
+		if(compressed)
+		{
+			/* Only the last piece has to end exactly where the chunk does. */
+			srcLen = cs;
+			result = LzmaDec_DecodeToDic(dec, src, &srcLen, n == us);
+			if(result != SZ_OK) return result;
+			if(dec->dicfPos != dec->dicfLimit) return SZ_ERROR_BAD_DICPOS;
+			src = src + srcLen;
+			cs = cs - srcLen;
+		}
+		else
+		{
+			/* Uncompressed chunk, at most 64 KiB. */
+			memcpy(dec->dicf + dec->dicfPos, src, n);
+			dec->dicfPos = dec->dicfLimit;
+
+			if((dec->checkDicSize == 0) && ((dec->dicSize - dec->processedPos) <= n))
+			{
+				dec->checkDicSize = dec->dicSize;
+			}
+
+			dec->processedPos = dec->processedPos + n;
+			src = src + n;
+		}
+
+		us = us - n;
+		if(0 == us) return SZ_OK;
+	}
+}
+
+/* Returns the size of the check field after each block for the check type
+ * in the stream flags, or BITS32 if it isn't supported.
+ */
+uint32_t ChecksumSize(uint32_t checkType)
+{
+	/* Based on https://tukaani.org/xz/xz-file-format-1.0.4.txt */
+	switch(checkType)
+	{
+		/* None */
+		case 0: return 0;
+		/* CRC32 */
+		case 1: return 4;
+		/* CRC64, typical xz output. */
+		case 4: return 8;
+		/* SHA-256 */
+		case 10: return 32;
+	}
+
+	return BITS32;
+}
+
+/* Reads a non-last filter flags record of a block header and pushes it onto dec.filters. */
+uint32_t ParseFilter(struct CLzmaDec* dec)
+{
+	struct XzFilter* f;
+	/* These are actually varints, but all supported values fit in a byte. */
+	uint32_t id = 0xFF & dec->readCur[0];
+	uint32_t size = 0xFF & dec->readCur[1];
+	dec->readCur = dec->readCur + 2;
+
+	if((FILTER_ID_DELTA != id) && (FILTER_ID_X86 != id) && (FILTER_ID_ARM64 != id)) return SZ_ERROR_UNSUPPORTED_FILTER_ID;
+
+	f = calloc(1, sizeof(struct XzFilter));
+	require(NULL != f, "Unable to allocate a filter\n");
+	f->buf = calloc(FILTER_BUF_SIZE, sizeof(uint8_t));
+	require(NULL != f->buf, "Unable to allocate a filter buffer\n");
+	f->id = id;
+	f->prevPos = BITS32 & (0 - 5);
+	f->next = dec->filters;
+	dec->filters = f;
+
+	if(FILTER_ID_DELTA == id)
+	{
+		if(1 != size) return SZ_ERROR_UNSUPPORTED_FILTER_PROPERTIES_SIZE;
+		f->distance = (0xFF & dec->readCur[0]) + 1;
+		f->history = calloc(256, sizeof(uint8_t));
+		require(NULL != f->history, "Unable to allocate the delta history\n");
+	}
+	else if(4 == size)
+	{
+		/* The start offset of the BCJ filter. */
+		f->pos = GetLE4(dec->readCur);
+	}
+	else if(0 != size) return SZ_ERROR_UNSUPPORTED_FILTER_PROPERTIES_SIZE;
+
+	dec->readCur = dec->readCur + size;
+	return SZ_OK;
+}
+
+/* Decodes an .xz block whose header size byte bhs is at readCur, up to and
+ * including its check field, and writes its output to destination. The
+ * header CRC32 and the check field of type checkType are verified.
+ */
+uint32_t DecodeXzBlock(struct CLzmaDec* dec, uint32_t bhs, uint32_t checkType)
+{
+	uint32_t checksumSize = ChecksumSize(checkType);
 	/* Block header flags */
 	uint32_t bhf;
 	uint32_t result;
 	/* uncompressed chunk size*/
 	uint32_t us;
-
-	/* needed by lzma */
-	uint32_t srcLen;
-	uint32_t res;
-
-	/* needed by xz */
-	uint8_t blockSizePad;
-	uint32_t bhs;
+	/* We need it modulo 4, so a uint8_t is enough. */
+	uint8_t blockSizePad = 3;
 	uint32_t bhs2;
 	uint8_t dicSizeProp;
 	uint8_t* readAtBlock;
 	uint8_t control;
-	uint8_t numRecords;
 	/* compressed chunk size */
 	uint32_t cs;
 	int initDic;
 	uint8_t mode;
 	int initState;
 	int isProp;
+	uint32_t numFilters;
 
-	/* 12 for the stream header + 12 for the first block header + 6 for the
-	 * first chunk header. empty.xz is 32 bytes.
-	 */
-	if(Preread(12 + 12 + 6) < 12 + 12 + 6)
+	FreeFilters(dec);
+
+	/* Block header size includes the bhs field and the CRC32 below. */
+	bhs = (bhs + 1) << 2;
+
+	/* Typically the Preread(dec, 12 + 12 + 6) above covers it. */
+	if(Preread(dec, bhs) < bhs)
 	{
 		return SZ_ERROR_INPUT_EOF;
 	}
 
-	/* readbuf[7] is actually stream flags, should also be 0. */
-	if(0 != memcmp(global->readCur, "\xFD""7zXZ\0", 7))
-	{
-		/* sanity check for lzma */
-		require((0xFF & global->readCur[0]) <= 225, "lzma check 1 failed");
-		require((0xFF & global->readCur[13]) == 0, "lzma check 2 failed");
-		require((((bhf = GetLE4(global->readCur + 9)) == 0) || (bhf == BITS32)), "lzma check 3 failed");
-		require((global->dicSize = GetLE4(global->readCur + 1)) >= LZMA_DIC_MIN, "lzma check 4 failed");
+	if(Crc32(0, dec->readCur, bhs - 4) != GetLE4(dec->readCur + bhs - 4)) return SZ_ERROR_CRC;
+	dec->readCur = dec->readCur + 1;
 
-		/* Based on https://svn.python.org/projects/external/xz-5.0.3/doc/lzma-file-format.txt */
-		/* TODO(pts): Support 8-byte uncompressed size. */
-		if(bhf == 0) us = GetLE4(global->readCur + 5);
-		else us = bhf;
+	readAtBlock = dec->readCur;
+	bhf = 0xFF & dec->readCur[0];
+	dec->readCur = dec->readCur + 1;
 
-		if(global->dicSize > MAX_DIC_SIZE) return SZ_ERROR_UNSUPPORTED_DICTIONARY_SIZE;
+	numFilters = (bhf & 3) + 1;
+	if((bhf & 20) != 0) return SZ_ERROR_BAD_BLOCK_FLAGS;
+	/* Compressed size present. */
+	/* Usually not present, just ignore it. */
+	if((bhf & 64) != 0) IgnoreVarint(dec);
+	/* Uncompressed size present. */
+	/* Usually not present, just ignore it. */
+	if((bhf & 128) != 0) IgnoreVarint(dec);
 
-		InitDecode();
-		global->allocCapacity = 0;
-		global->dicf = NULL;
-		/* LZMA2 restricts lc + lp <= 4. LZMA requires lc + lp <= 12.
-		 * We apply the LZMA2 restriction here (to save memory in
-		 * CLzmaDec.probs), thus we are not able to extract some legitimate
-		 * .lzma files.
-		 */
-		result = (InitProp(0xFF & global->readCur[0]));
+	/* BCJ and delta filters come first, LZMA2 has to be the last one. */
+	while(numFilters > 1)
+	{
+		result = ParseFilter(dec);
 		if(result != SZ_OK) return result;
+		numFilters = numFilters - 1;
+	}
 
-		global->readCur = global->readCur + 13;  /* Start decompressing the 0 byte. */
-		global->dicfLimit = global->writeRemaining;
-		global->writeRemaining = us;
+	/* This is actually a varint, but it's shorter to read it as a byte. */
+	if((0xFF & dec->readCur[0]) != FILTER_ID_LZMA2) return SZ_ERROR_UNSUPPORTED_FILTER_ID;
+	dec->readCur = dec->readCur + 1;
 
-		if(us <= global->dicSize) GrowCapacity(us);
+	/* This is actually a varint, but it's shorter to read it as a byte. */
+	if((0xFF & dec->readCur[0]) != 1) return SZ_ERROR_UNSUPPORTED_FILTER_PROPERTIES_SIZE;
+	dec->readCur = dec->readCur + 1;
 
-		while((global->discardedSize + global->dicfPos) != us)
-		{
+	dicSizeProp = 0xFF & dec->readCur[0];
+	dec->readCur = dec->readCur + 1;
 
-			if((srcLen = Preread(sizeof_readBuf)) == 0)
-			{
-				if(us != BITS32) return SZ_ERROR_INPUT_EOF;
-				break;
-			}
+	/* Typical large dictionary sizes:
+	 * 35: 805306368 bytes == 768 MiB
+	 * 36: 1073741824 bytes == 1 GiB
+	 * 37: 1610612736 bytes, largest supported by .xz
+	 * 38: 2147483648 bytes == 2 GiB
+	 * 39: 3221225472 bytes == 3 GiB
+	 * 40: 4294967295 bytes, largest supported by .7z
+	 */
+	if(dicSizeProp > 40) return SZ_ERROR_BAD_DICTIONARY_SIZE;
 
-			res = LzmaDec_DecodeToDic(global->readCur, srcLen);
-			global->readCur = global->readCur + srcLen;
+	/* LZMA2 and .xz support it, we don't (for simpler memory management on
+	 * 32-bit systems).
+	 */
+	if(dicSizeProp > MAX_DIC_SIZE_PROP) return SZ_ERROR_UNSUPPORTED_DICTIONARY_SIZE;
 
-			if(res == SZ_ERROR_FINISHED_WITH_MARK) break;
+	/* Works if dicSizeProp <= 39. */
+	dec->dicSize = ((2 | ((dicSizeProp) & 1)) << ((dicSizeProp) / 2 + 11));
+	require(dec->dicSize >= LZMA_DIC_MIN, "dec->dicSize >= LZMA_DIC_MIN");
+	/* dicf is allocated on demand by GrowDic. */
+	dec->dicBufSize = dec->dicSize;
+	bhs2 = dec->readCur - readAtBlock + 5;
 
-			if(res != SZ_ERROR_NEEDS_MORE_INPUT && res != SZ_OK) return res;
-		}
+	if(bhs2 > bhs) return SZ_ERROR_BLOCK_HEADER_TOO_LONG;
 
-		Flush();
-		return SZ_OK;
-	}
+	result = IgnoreZeroBytes(dec, bhs - bhs2);
+	if(result != 0) return result;
+
+	/* Skip the CRC32, it was checked above. */
+	dec->readCur = dec->readCur + 4;
+	/* Typically it's offset 24, xz creates it by default, minimal. */
 
-	global->allocCapacity = 0;
-	global->dicf = NULL;
+	/* Finally Parse LZMA2 stream. */
+	InitDecode(dec);
+	dec->checkType = checkType;
+	InitCheck(dec);
 
 	while(TRUE)
 	{
-		/* Based on https://tukaani.org/xz/xz-file-format-1.0.4.txt */
-		switch(0xFF & global->readCur[7])
+		require(dec->dicfPos == dec->dicfLimit, "dec->dicfPos == dec->dicfLimit");
+
+		/* Actually 2 bytes is enough to get to the index if everything is
+		 * aligned and there is no block checksum.
+		 */
+		if(Preread(dec, 6) < 6) return SZ_ERROR_INPUT_EOF;
+		control = 0xFF & dec->readCur[0];
+
+		if(control == 0)
 		{
-			/* None */
-			case 0: checksumSize = 1;
-					break;
-			/* CRC32 */
-			case 1: checksumSize = 4;
-					break;
-			/* CRC64, typical xz output. */
-			case 4: checksumSize = 8;
-					break;
-			default: return SZ_ERROR_BAD_CHECKSUM_TYPE;
+			dec->readCur = dec->readCur + 1;
+			break;
 		}
+		else if(((control - 3) & 0xFF) < 0x7D) return SZ_ERROR_BAD_CHUNK_CONTROL_BYTE;
 
-		/* Also ignore the CRC32 after checksumSize. */
-		global->readCur = global->readCur + 12;
+		us = ((0xFF & dec->readCur[1]) << 8) + (0xFF & dec->readCur[2]) + 1;
 
-		while(TRUE)
+		/* Uncompressed chunk. */
+		if(control < 3)
 		{
-			/* We need it modulo 4, so a uint8_t is enough. */
-			blockSizePad = 3;
-			require(global->readEnd - global->readCur >= 12, "readEnd - readCur >= 12");  /* At least 12 bytes preread. */
+			/* assume it was already setup */
+			initDic = FALSE;
+			cs = us;
+			dec->readCur = dec->readCur + 3;
+			blockSizePad = blockSizePad - 3;
+
+			/* now test that assumption */
+			if(control == 1)
+			{
+				dec->needInitProp = dec->needInitState;
+				dec->needInitState = TRUE;
+				dec->needInitDic = FALSE;
+			}
+			else if(dec->needInitDic) return SZ_ERROR_DATA;
 
-			bhs = 0xFF & global->readCur[0];
-			/* Last block, index follows. */
-			if(bhs == 0)
+			LzmaDec_InitDicAndState(dec, initDic, FALSE);
+		}
+		else
+		{
+			/* LZMA chunk. */
+			mode = (((control) >> 5) & 3);
+			if(mode == 3) initDic = TRUE;
+			else initDic = FALSE;
+
+			if(mode > 0) initState = TRUE;
+			else initState = FALSE;
+
+			if((control & 64) != 0) isProp = TRUE;
+			else isProp = FALSE;
+
+			us = us + ((control & 31) << 16);
+			cs = ((0xFF & dec->readCur[3]) << 8) + (0xFF & dec->readCur[4]) + 1;
+
+			if(isProp)
 			{
-				global->readCur = global->readCur + 1;
-				/* This is actually a varint, but it's shorter to read it as a byte. */
-				numRecords = 0xFF & global->readCur[0];
-				global->readCur = global->readCur + 1;
-				while(0 != numRecords) {
-					/* a varint is at most 9 bytes long, but may be shorter */
-					Preread(9);
-					IgnoreVarint();
-					Preread(9);
-					IgnoreVarint();
-					numRecords = numRecords - 1;
-				}
-				/* Synchronize to 4-byte boundary */
-				if (0 != ((pos - (global->readEnd - global->readCur)) & 3)) {
-					Preread(4 - ((pos - (global->readEnd - global->readCur)) & 3));
-					global->readCur = global->readCur + (4 - ((pos - (global->readEnd - global->readCur)) & 3));
-				}
-				/* Consume crc32 of index + stream footer */
-				Preread(16);
-				global->readCur = global->readCur + 16;
-				break;
+				result = InitProp(dec, 0xFF & dec->readCur[5]);
+				if(result != 0) return result;
+
+				dec->readCur = dec->readCur + 1;
+				blockSizePad = blockSizePad - 1;
 			}
-			global->readCur = global->readCur + 1;
+			else if(dec->needInitProp) return SZ_ERROR_MISSING_INITPROP;
 
-			/* Block header size includes the bhs field above and the CRC32 below. */
-			bhs = (bhs + 1) << 2;
+			dec->readCur = dec->readCur + 5;
+			blockSizePad = blockSizePad - 5;
 
-			/* Typically the Preread(12 + 12 + 6) above covers it. */
-			if(Preread(bhs) < bhs)
+			if((!initDic && dec->needInitDic) || (!initState && dec->needInitState))
 			{
-				return SZ_ERROR_INPUT_EOF;
+				return SZ_ERROR_DATA;
 			}
 
-			readAtBlock = global->readCur;
-			bhf = 0xFF & global->readCur[0];
-			global->readCur = global->readCur + 1;
-
-			if((bhf & 2) != 0) return SZ_ERROR_UNSUPPORTED_FILTER_COUNT;
-			if((bhf & 20) != 0) return SZ_ERROR_BAD_BLOCK_FLAGS;
-			/* Compressed size present. */
-			/* Usually not present, just ignore it. */
-			if((bhf & 64) != 0) IgnoreVarint();
-			/* Uncompressed size present. */
-			/* Usually not present, just ignore it. */
-			if((bhf & 128) != 0) IgnoreVarint();
-
-			/* This is actually a varint, but it's shorter to read it as a byte. */
-			if((0xFF & global->readCur[0]) != FILTER_ID_LZMA2) return SZ_ERROR_UNSUPPORTED_FILTER_ID;
-			global->readCur = global->readCur + 1;
-
-			/* This is actually a varint, but it's shorter to read it as a byte. */
-			if((0xFF & global->readCur[0]) != 1) return SZ_ERROR_UNSUPPORTED_FILTER_PROPERTIES_SIZE;
-			global->readCur = global->readCur + 1;
-
-			dicSizeProp = 0xFF & global->readCur[0];
-			global->readCur = global->readCur + 1;
-
-			/* Typical large dictionary sizes:
-			 * 35: 805306368 bytes == 768 MiB
-			 * 36: 1073741824 bytes == 1 GiB
-			 * 37: 1610612736 bytes, largest supported by .xz
-			 * 38: 2147483648 bytes == 2 GiB
-			 * 39: 3221225472 bytes == 3 GiB
-			 * 40: 4294967295 bytes, largest supported by .7z
-			 */
-			if(dicSizeProp > 40) return SZ_ERROR_BAD_DICTIONARY_SIZE;
-
-			/* LZMA2 and .xz support it, we don't (for simpler memory management on
-			 * 32-bit systems).
-			 */
-			if(dicSizeProp > MAX_DIC_SIZE_PROP) return SZ_ERROR_UNSUPPORTED_DICTIONARY_SIZE;
-
-			/* Works if dicSizeProp <= 39. */
-			global->dicSize = ((2 | ((dicSizeProp) & 1)) << ((dicSizeProp) / 2 + 11));
-			/* TODO(pts): Free dic after use, also after realloc error. */
-			require(global->dicSize >= LZMA_DIC_MIN, "global->dicSize >= LZMA_DIC_MIN");
-			GrowCapacity(global->dicSize + MAX_MATCH_SIZE + sizeof_writeBuf);
-			bhs2 = global->readCur - readAtBlock + 5;
-
-			if(bhs2 > bhs) return SZ_ERROR_BLOCK_HEADER_TOO_LONG;
-
-			result = IgnoreZeroBytes(bhs - bhs2);
-			if(result != 0) return result;
+			LzmaDec_InitDicAndState(dec, initDic, initState);
+			dec->needInitDic = FALSE;
+			dec->needInitState = FALSE;
+		}
+
+		require(us <= (1 << 24), "us <= (1 << 24)");
+		require(cs <= (1 << 16), "cs <= (1 << 16)");
+		require(dec->dicfPos == dec->dicfLimit, "dec->dicfPos == dec->dicfLimit");
 
-			/* Ignore CRC32. */
-			global->readCur = global->readCur + 4;
-			/* Typically it's offset 24, xz creates it by default, minimal. */
+		/* Read 6 extra bytes to optimize away a read(...) system call in
+		 * the Prefetch(6) call in the next chunk header.
+		 */
+		if(Preread(dec, cs + 6) < cs) return SZ_ERROR_INPUT_EOF;
 
-			/* Finally Parse LZMA2 stream. */
-			InitDecode();
+		result = DecodeChunk(dec, control >= 3, us, cs);
+		if(result != 0) return result;
 
-			while(TRUE)
-			{
-				require(global->dicfPos == global->dicfLimit, "global->dicfPos == global->dicfLimit");
+		dec->readCur = dec->readCur + cs;
+		blockSizePad = blockSizePad - cs;
+		/* Stream the output out as we go, only the circular dictionary
+		 * has to stay around for backreferences.
+		 */
+		Flush(dec);
+	}
 
-				/* Actually 2 bytes is enough to get to the index if everything is
-				 * aligned and there is no block checksum.
-				 */
-				if(Preread(6) < 6) return SZ_ERROR_INPUT_EOF;
-				control = 0xFF & global->readCur[0];
+	Flush(dec);
+	/* End of LZMA2 stream. */
 
-				if(control == 0)
-				{
-					global->readCur = global->readCur + 1;
-					break;
-				}
-				else if(((control - 3) & 0xFF) < 0x7D) return SZ_ERROR_BAD_CHUNK_CONTROL_BYTE;
+	/* The last few bytes held back by a BCJ filter go out unchanged. */
+	if(NULL != dec->filters)
+	{
+		FilterWrite(dec, dec->filters, NULL, 0, TRUE);
+		FreeFilters(dec);
+	}
 
-				us = ((0xFF & global->readCur[1]) << 8) + (0xFF & global->readCur[2]) + 1;
+	/* End of block. */
+	/* 3 for padding4, the check + 12 for the next block header + 6 for the next
+	 * chunk header.
+	 */
+	if(Preread(dec, 3 + checksumSize + 12 + 6) < 3 + checksumSize + 12 + 6) return SZ_ERROR_INPUT_EOF;
+	/* Ignore block padding. */
+	result = (IgnoreZeroBytes(dec, blockSizePad & 3));
+	if(result != 0) return result;
 
-				/* Uncompressed chunk. */
-				if(control < 3)
-				{
-					/* assume it was already setup */
-					initDic = FALSE;
-					cs = us;
-					global->readCur = global->readCur + 3;
-					blockSizePad = blockSizePad - 3;
-
-					/* now test that assumption */
-					if(control == 1)
-					{
-						global->needInitProp = global->needInitState;
-						global->needInitState = TRUE;
-						global->needInitDic = FALSE;
-					}
-					else if(global->needInitDic) return SZ_ERROR_DATA;
+	result = VerifyCheck(dec, dec->readCur);
+	if(result != 0) return result;
 
-					LzmaDec_InitDicAndState(initDic, FALSE);
-				}
-				else
-				{
-					/* LZMA chunk. */
-					mode = (((control) >> 5) & 3);
-					if(mode == 3) initDic = TRUE;
-					else initDic = FALSE;
+	dec->readCur = dec->readCur + checksumSize;
+	return SZ_OK;
+}
 
-					if(mode > 0) initState = TRUE;
-					else initState = FALSE;
+/* Reads .xz or .lzma data from source, writes uncompressed bytes to destination,
+ * uses CLzmaDec.dic. It verifies some aspects of the file format (so it
+ * can't be tricked to an infinite loop etc.), and for .xz the header, index
+ * and footer CRC32s and the check of each block.
+ */
+uint32_t DecompressXzOrLzma(struct CLzmaDec* dec)
+{
+	uint32_t checkType;
+	uint32_t numBlocks;
+	/* Block header flags */
+	uint32_t bhf;
+	uint32_t result;
+	/* uncompressed chunk size*/
+	uint32_t us;
 
-					if((control & 64) != 0) isProp = TRUE;
-					else isProp = FALSE;
+	/* needed by lzma */
+	uint32_t srcLen;
+	uint32_t res;
+	uint32_t dicfPos0;
 
-					us = us + ((control & 31) << 16);
-					cs = ((0xFF & global->readCur[3]) << 8) + (0xFF & global->readCur[4]) + 1;
+	/* needed by xz */
+	uint32_t bhs;
 
-					if(isProp)
-					{
-						result = InitProp(0xFF & global->readCur[5]);
-						if(result != 0) return result;
+	/* 12 for the stream header + 12 for the first block header + 6 for the
+	 * first chunk header. empty.xz is 32 bytes.
+	 */
+	if(Preread(dec, 12 + 12 + 6) < 12 + 12 + 6)
+	{
+		return SZ_ERROR_INPUT_EOF;
+	}
 
-						global->readCur = global->readCur + 1;
-						blockSizePad = blockSizePad - 1;
-					}
-					else if(global->needInitProp) return SZ_ERROR_MISSING_INITPROP;
+	/* readbuf[7] is actually stream flags, should also be 0. */
+	if(0 != memcmp(dec->readCur, "\xFD""7zXZ\0", 7))
+	{
+		/* sanity check for lzma */
+		require((0xFF & dec->readCur[0]) <= 225, "lzma check 1 failed");
+		require((0xFF & dec->readCur[13]) == 0, "lzma check 2 failed");
+		require((((bhf = GetLE4(dec->readCur + 9)) == 0) || (bhf == BITS32)), "lzma check 3 failed");
+		require((dec->dicSize = GetLE4(dec->readCur + 1)) >= LZMA_DIC_MIN, "lzma check 4 failed");
 
-					global->readCur = global->readCur + 5;
-					blockSizePad = blockSizePad - 5;
+		/* Based on https://svn.python.org/projects/external/xz-5.0.3/doc/lzma-file-format.txt */
+		/* TODO(pts): Support 8-byte uncompressed size. */
+		if(bhf == 0) us = GetLE4(dec->readCur + 5);
+		else us = bhf;
 
-					if((!initDic && global->needInitDic) || (!initState && global->needInitState))
-					{
-						return SZ_ERROR_DATA;
-					}
+		if(dec->dicSize > MAX_DIC_SIZE) return SZ_ERROR_UNSUPPORTED_DICTIONARY_SIZE;
 
-					LzmaDec_InitDicAndState(initDic, initState);
-					global->needInitDic = FALSE;
-					global->needInitState = FALSE;
-				}
+		InitDecode(dec);
+		dec->allocCapacity = 0;
+		dec->dicf = NULL;
+		/* LZMA2 restricts lc + lp <= 4. LZMA requires lc + lp <= 12.
+		 * We apply the LZMA2 restriction here (to save memory in
+		 * CLzmaDec.probs), thus we are not able to extract some legitimate
+		 * .lzma files.
+		 */
+		result = (InitProp(dec, 0xFF & dec->readCur[0]));
+		if(result != SZ_OK) return result;
 
-				require(us <= (1 << 24), "us <= (1 << 24)");
-				require(cs <= (1 << 16), "cs <= (1 << 16)");
-				require(global->dicfPos == global->dicfLimit, "global->dicfPos == global->dicfLimit");
-				FlushDiscardOldFromStartOfDic();
-				global->dicfLimit = global->dicfLimit + us;
+		dec->readCur = dec->readCur + 13;  /* Start decompressing the 0 byte. */
+		dec->dicBufSize = dec->dicSize;
+		dec->writeRemaining = us;
 
-				if(global->dicfLimit < us) return SZ_ERROR_MEM;
+		while(dec->writeRemaining != 0)
+		{
+			if(dec->dicfPos == dec->dicBufSize) FlushWrap(dec);
 
-				/* Read 6 extra bytes to optimize away a read(...) system call in
-				 * the Prefetch(6) call in the next chunk header.
-				 */
-				if(Preread(cs + 6) < cs) return SZ_ERROR_INPUT_EOF;
+			dec->dicfLimit = dec->dicBufSize;
+			if(dec->dicfLimit - dec->dicfPos > dec->writeRemaining)
+			{
+				dec->dicfLimit = dec->dicfPos + dec->writeRemaining;
+			}
+			GrowDic(dec, dec->dicfLimit);
 
-				/* Uncompressed chunk, at most 64 KiB. */
-				if(control < 3)
-				{
-					require((global->dicfPos + us) == global->dicfLimit, "global->dicfPos + us == global->dicfLimit");
-					FlushDiscardGrowDic(us);
-					memcpy(global->dicf + global->dicfPos, global->readCur, us);
-					global->dicfPos = global->dicfPos + us;
+			if((srcLen = Preread(dec, sizeof_readBuf)) == 0)
+			{
+				if(us != BITS32) return SZ_ERROR_INPUT_EOF;
+				break;
+			}
 
-					if((global->checkDicSize == 0) && ((global->dicSize - global->processedPos) <= us))
-					{
-						global->checkDicSize = global->dicSize;
-					}
+			dicfPos0 = dec->dicfPos;
+			res = LzmaDec_DecodeToDic(dec, dec->readCur, &srcLen, FALSE);
+			dec->readCur = dec->readCur + srcLen;
+			if(us != BITS32) dec->writeRemaining = dec->writeRemaining - (dec->dicfPos - dicfPos0);
 
-					global->processedPos = global->processedPos + us;
-				}
-				else
-				{
-					/* Compressed chunk. */
-					/* This call doesn't change global->dicfLimit. */
-					result = LzmaDec_DecodeToDic(global->readCur, cs);
+			if(res == SZ_ERROR_FINISHED_WITH_MARK) break;
 
-					if(result != 0) return result;
-				}
+			if(res != SZ_ERROR_NEEDS_MORE_INPUT && res != SZ_OK) return res;
+		}
 
-				if(global->dicfPos != global->dicfLimit) return SZ_ERROR_BAD_DICPOS;
+		Flush(dec);
+		return SZ_OK;
+	}
 
-				global->readCur = global->readCur + cs;
-				blockSizePad = blockSizePad - cs;
-				/* We can't discard decompressbuf[:global->dicfLimit] now,
-				 * because we need it a dictionary in which subsequent calls to
-				 * Lzma2Dec_DecodeToDic will look up backreferences.
-				 */
-			}
+	dec->allocCapacity = 0;
+	dec->dicf = NULL;
 
-			Flush();
-			/* End of LZMA2 stream. */
+	while(TRUE)
+	{
+		checkType = 0xFF & dec->readCur[7];
+		if(ChecksumSize(checkType) == BITS32) return SZ_ERROR_BAD_CHECKSUM_TYPE;
+		if(Crc32(0, dec->readCur + 6, 2) != GetLE4(dec->readCur + 8)) return SZ_ERROR_CRC;
 
-			/* End of block. */
-			/* 7 for padding4 and CRC32 + 12 for the next block header + 6 for the next
-			 * chunk header.
-			 */
-			if(Preread(7 + 12 + 6) < 7 + 12 + 6) return SZ_ERROR_INPUT_EOF;
-			/* Ignore block padding. */
-			result = (IgnoreZeroBytes(blockSizePad & 3));
-			if(result != 0) return result;
+		dec->readCur = dec->readCur + 12;
+		numBlocks = 0;
+
+		while(TRUE)
+		{
+			require(dec->readEnd - dec->readCur >= 12, "readEnd - readCur >= 12");  /* At least 12 bytes preread. */
+
+			bhs = 0xFF & dec->readCur[0];
+			/* Last block, index follows. */
+			if(bhs == 0)
+			{
+				result = SkipXzIndex(dec, numBlocks, checkType);
+				if(result != 0) return result;
+				break;
+			}
 
-			global->readCur = global->readCur + checksumSize;  /* Ignore CRC32, CRC64 etc. */
+			result = DecodeXzBlock(dec, bhs, checkType);
+			if(result != 0) return result;
+			numBlocks = numBlocks + 1;
 		}
 
 		/* Look for another concatenated stream */
@@ -2339,12 +3174,12 @@ uint32_t DecompressXzOrLzma()
 		/* 12 for the stream header + 12 for the first block header + 6 for the
 		 * first chunk header. empty.xz is 32 bytes.
 		 */
-		if(Preread(12 + 12 + 6) < 12 + 12 + 6)
+		if(Preread(dec, 12 + 12 + 6) < 12 + 12 + 6)
 		{
 			break;
 		}
 
-		if(0 != memcmp(global->readCur, "\xFD""7zXZ\0", 7)) {
+		if(0 != memcmp(dec->readCur, "\xFD""7zXZ\0", 7)) {
 			break;
 		}
 	}
@@ -2353,15 +3188,205 @@ uint32_t DecompressXzOrLzma()
 	return SZ_OK;
 }
 
+#if !defined(__M2__)
+/* A block of a mapped .xz file decompressed into memory on its own thread. */
+struct XzJob
+{
+	pthread_t thread;
+	uint8_t* in;  /* The block header size byte. */
+	uint8_t* end;  /* The end of the file, DecodeXzBlock reads a bit past the block. */
+	uint32_t checkType;
+	size_t us;  /* Uncompressed size according to the index. */
+	struct CLzmaDec* state;
+	uint32_t rc;
+};
+
+void* XzJobRun(void* arg)
+{
+	struct XzJob* job = arg;
+	struct CLzmaDec* dec = NewDecoder(-1, -1);
+
+	dec->readBuf = job->in;
+	dec->readCur = job->in;
+	dec->readEnd = job->end;
+	dec->memOutSize = job->us;
+	dec->memOut = malloc(job->us + 1);
+	require(NULL != dec->memOut, "Unable to allocate the output buffer\n");
+
+	job->rc = DecodeXzBlock(dec, 0xFF & job->in[0], job->checkType);
+	if((job->rc == SZ_OK) && (dec->memOutLen != job->us)) job->rc = SZ_ERROR_DATA;
+	job->state = dec;
+	return NULL;
+}
+
+/* Reads a varint at p[0] not going past end, returns 0 if it doesn't fit. */
+int ReadXzVarint(uint8_t** p, uint8_t* end, size_t* value)
+{
+	int shift = 0;
+	uint8_t b;
+	value[0] = 0;
+
+	do
+	{
+		if((p[0] >= end) || (shift > 56)) return FALSE;
+		b = p[0][0];
+		p[0] = p[0] + 1;
+		value[0] = value[0] | ((size_t)(b & 0x7F) << shift);
+		shift = shift + 7;
+	} while(b >= 0x80);
+
+	return TRUE;
+}
+
+/* Decompresses a mapped single-stream .xz file with many blocks on up to
+ * threads threads at once, writing the blocks in order. The block offsets and
+ * sizes come from the index, found through the stream footer. Returns
+ * BITS32 without writing anything if the file isn't laid out like that, so
+ * the caller can decode it serially instead.
+ */
+uint32_t DecompressXzParallel(int destination, uint8_t* data, size_t len, int threads)
+{
+	struct XzJob* jobs;
+	uint8_t* index;
+	uint8_t* p;
+	size_t indexSize;
+	size_t numRecords;
+	size_t record;
+	size_t offset = 12;
+	size_t unpadded;
+	size_t us;
+	uint32_t checkType;
+	size_t next;
+	size_t held;
+	struct CLzmaDec* dec;
+	uint32_t rc = SZ_OK;
+
+	if((threads < 2) || (len < 12 + 8 + 12)) return BITS32;
+	if(0 != memcmp(data, "\xFD""7zXZ\0", 7)) return BITS32;
+	/* No stream padding or concatenated streams, the footer flags match. */
+	if((data[len - 2] != 'Y') || (data[len - 1] != 'Z')) return BITS32;
+	if((data[len - 4] != data[6]) || (data[len - 3] != data[7])) return BITS32;
+	checkType = data[7];
+	if(ChecksumSize(checkType) == BITS32) return BITS32;
+	if(Crc32(0, data + 6, 2) != GetLE4(data + 8)) return BITS32;
+	if(Crc32(0, data + len - 8, 6) != GetLE4(data + len - 12)) return BITS32;
+
+	indexSize = ((size_t)GetLE4(data + len - 8) + 1) * 4;
+	if(indexSize > len - 12 - 12) return BITS32;
+	index = data + len - 12 - indexSize;
+	p = index + 1;
+	if(Crc32(0, index, indexSize - 4) != GetLE4(index + indexSize - 4)) return BITS32;
+	if((index[0] != 0) || !ReadXzVarint(&p, index + indexSize, &numRecords)) return BITS32;
+	/* Each record takes at least two bytes. */
+	if((numRecords < 2) || (numRecords > indexSize / 2)) return BITS32;
+
+	jobs = calloc(numRecords, sizeof(struct XzJob));
+	require(NULL != jobs, "Unable to allocate the decompression jobs\n");
+
+	for(record = 0; record < numRecords; record = record + 1)
+	{
+		if(!ReadXzVarint(&p, index + indexSize, &unpadded) || !ReadXzVarint(&p, index + indexSize, &us)
+		   || (us > BITS32) || (unpadded > (size_t)(index - data)))
+		{
+			free(jobs);
+			return BITS32;
+		}
+
+		jobs[record].in = data + offset;
+		jobs[record].end = data + len;
+		jobs[record].checkType = checkType;
+		jobs[record].us = us;
+		offset = offset + ((unpadded + 3) & ~3);
+		if(offset > (size_t)(index - data)) break;
+	}
+
+	/* The blocks have to tile the stream exactly up to the index. */
+	if((record != numRecords) || (offset != (size_t)(index - data)))
+	{
+		free(jobs);
+		return BITS32;
+	}
+
+	/* A window of blocks decodes ahead of the one being written, a new one
+	 * starting as each is written, for as long as their output fits in
+	 * PARALLEL_OUT_MAX. A block too big for that is decoded straight to
+	 * destination on this thread once the blocks before it are out.
+	 */
+	record = 0;
+	next = 0;
+	held = 0;
+	while((rc == SZ_OK) && (record < numRecords))
+	{
+		while((next < numRecords) && (next - record < (size_t)threads) && (held + jobs[next].us <= PARALLEL_OUT_MAX))
+		{
+			if(0 != pthread_create(&jobs[next].thread, NULL, XzJobRun, jobs + next))
+			{
+				jobs[next].thread = pthread_self();
+				XzJobRun(jobs + next);
+			}
+			held = held + jobs[next].us;
+			next = next + 1;
+		}
+
+		if(next == record)
+		{
+			dec = NewDecoder(-1, destination);
+			dec->readBuf = jobs[record].in;
+			dec->readCur = jobs[record].in;
+			dec->readEnd = jobs[record].end;
+			rc = DecodeXzBlock(dec, 0xFF & jobs[record].in[0], checkType);
+			FreeDecoder(dec);
+			record = record + 1;
+			next = record;
+			continue;
+		}
+
+		if(!pthread_equal(jobs[record].thread, pthread_self()))
+		{
+			pthread_join(jobs[record].thread, NULL);
+		}
+
+		rc = jobs[record].rc;
+		if(rc == SZ_OK) WriteAll(destination, jobs[record].state->memOut, jobs[record].state->memOutLen);
+		FreeDecoder(jobs[record].state);
+		held = held - jobs[record].us;
+		record = record + 1;
+	}
+
+	/* After an error, let the blocks still running finish before letting go of them */
+	for(; record < next; record = record + 1)
+	{
+		if(!pthread_equal(jobs[record].thread, pthread_self()))
+		{
+			pthread_join(jobs[record].thread, NULL);
+		}
+		FreeDecoder(jobs[record].state);
+	}
+
+	free(jobs);
+	return rc;
+}
+#endif
+
 int main(int argc, char **argv)
 {
 	uint32_t res;
 	char* name;
 	char* dest;
+	int source;
+	int destination;
+	struct CLzmaDec* dec;
+#if defined(__M2__)
+	int threads = 1;
+#else
+	int threads = sysconf(_SC_NPROCESSORS_ONLN);
+	struct stat st;
+	uint8_t* data;
+#endif
 	FUZZING = FALSE;
+	STATS = FALSE;
 	name = NULL;
 	dest = NULL;
-	pos = 0;
 
 	/* process arguments */
 	int i = 1;
@@ -2389,14 +3414,28 @@ int main(int argc, char **argv)
 			fputs("fuzz-mode enabled, preparing for chaos\n", stderr);
 			i = i + 1;
 		}
+		else if(match(argv[i], "-j") || match(argv[i], "--jobs"))
+		{
+			require(NULL != argv[i+1], "the --jobs option requires a number to be given\n");
+			threads = strtoint(argv[i+1]);
+			require(threads > 0, "the --jobs option requires a positive number\n");
+			i = i + 2;
+		}
+		else if(match(argv[i], "--stats"))
+		{
+			STATS = TRUE;
+			i = i + 1;
+		}
 		else if(match(argv[i], "-h") || match(argv[i], "--help"))
 		{
 			fputs("Usage: ", stderr);
 			fputs(argv[0], stderr);
 			fputs(" [--file $input.xz or --file $input.lzma] (or it'll read from stdin)\n", stderr);
 			fputs(" [--output $output] (or it'll write to stdout)\n", stderr);
+			fputs("--jobs $n to decompress up to n blocks of a seekable .xz file at once\n", stderr);
 			fputs("--help to get this message\n", stderr);
 			fputs("--fuzz-mode if you wish to fuzz this application safely\n", stderr);
+			fputs("--stats to print the dictionary size and number of times it grew\n", stderr);
 			exit(EXIT_SUCCESS);
 		}
 		else
@@ -2408,28 +3447,54 @@ int main(int argc, char **argv)
 		}
 	}
 
-	if(NULL != name) source = fopen(name, "r");
-	else source = stdin;
-	if(source == NULL)
+	if(NULL != name) source = open(name, 0, 0);
+	else source = STDIN_FILENO;
+	if(source < 0)
 	{
 		fputs("File ", stderr);
 		fputs(name, stderr);
 		fputs(" not found!\n", stderr);
 		return 1;
 	}
-	if(NULL != dest) destination = fopen(dest, "w");
-	else destination = stdout;
-
-	if(FUZZING) destination = fopen("/dev/null", "w");
-	global = calloc(1, sizeof(struct CLzmaDec));
-	global->readBuf = calloc(sizeof_readBuf, sizeof(uint8_t));
-	global->readCur = global->readBuf;
-	global->readEnd = global->readBuf;
-	global->allocCapacity = 0;
-	global->dicSize = 0;
-	res = DecompressXzOrLzma();
-	free(global->dicf);  /* Pacify valgrind(1). */
-	free(global->readBuf);
-	free(global);
+	if(FUZZING) destination = open("/dev/null", O_WRONLY|O_CREAT|O_TRUNC, 0600);
+	else if(NULL != dest) destination = open(dest, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+	else destination = STDOUT_FILENO;
+	if(destination < 0)
+	{
+		fputs("Unable to open output file for writing\n", stderr);
+		return 1;
+	}
+
+	InitCheckTables();
+	dec = NewDecoder(source, destination);
+#if !defined(__M2__)
+	/* Multi-block files can have their blocks decoded in parallel. */
+	res = BITS32;
+	if((threads > 1) && (0 == fstat(source, &st)) && S_ISREG(st.st_mode) && (st.st_size > 0))
+	{
+		data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, source, 0);
+
+		if(MAP_FAILED != data)
+		{
+			res = DecompressXzParallel(destination, data, st.st_size, threads);
+			munmap(data, st.st_size);
+		}
+	}
+
+	if(res == BITS32) res = DecompressXzOrLzma(dec);
+#else
+	res = DecompressXzOrLzma(dec);
+#endif
+
+	if(STATS)
+	{
+		fputs("dictionary bytes allocated: ", stderr);
+		fputs(int2str(dec->allocCapacity, 10, FALSE), stderr);
+		fputs("\ndictionary grow events: ", stderr);
+		fputs(int2str(dec->growCount, 10, FALSE), stderr);
+		fputs("\n", stderr);
+	}
+
+	FreeDecoder(dec);  /* Pacify valgrind(1). */
 	return res;
 }